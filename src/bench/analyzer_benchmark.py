@@ -0,0 +1,55 @@
+import os, sys, time, resource, tempfile, subprocess;
+
+# Generates an input of about the given number of lines: chains of
+# functions whose bodies nest lambdas and variable length arrays, half of
+# them reachable from main.
+def generate(lines):
+    functions = max(lines // 10, 1)
+    out = []
+    for i in range(functions):
+        out.append('int s%d(int n){ return n + 1; }' % i)
+        out.append('int f%d(int n){' % i)
+        out.append('\tint a[s%d(n)];' % i)
+        out.append('\tauto g = [n](int x){')
+        out.append('\t\tauto h = [x](int y){ return x + y; };')
+        out.append('\t\treturn h(n) + %s;' % ('f%d(x - 1)' % (i - 1) if i > 0 else '0'))
+        out.append('\t};')
+        out.append('\ta[0] = g(n);')
+        out.append('\treturn a[0];')
+        out.append('}')
+    out.append('int main(){')
+    out.append('\treturn f%d(1);' % (functions // 2))
+    out.append('}')
+    return '\n'.join(out) + '\n'
+
+# Runs the simplifier once and returns the wall time and the peak resident
+# set size of the child in KiB
+def measure(simplifier_path, input_path, args):
+    begin = time.time()
+    with open(os.devnull, 'w') as devnull:
+        pid = subprocess.Popen(
+            [simplifier_path] + args + [input_path], stdout=devnull).pid
+        _, status, usage = os.wait4(pid, 0)
+    elapsed = time.time() - begin
+    if status != 0:
+        raise RuntimeError('%s exited with status %d' % (simplifier_path, status))
+    return elapsed, usage.ru_maxrss
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print('Usage: python %s simplifier_path [lines] [simplifier options...]' % sys.argv[0])
+        quit()
+    simplifier_path = sys.argv[1]
+    lines = 50000
+    if len(sys.argv) >= 3:
+        lines = int(sys.argv[2])
+    args = sys.argv[3:]
+    with tempfile.NamedTemporaryFile(mode='w', suffix='.cpp', delete=False) as f:
+        f.write(generate(lines))
+        input_path = f.name
+    try:
+        elapsed, rss = measure(simplifier_path, input_path, args)
+        print('%d lines: %.3f s, max RSS %d KiB' % (lines, elapsed, rss))
+    finally:
+        os.remove(input_path)
@@ -0,0 +1,64 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "../line_index.hpp"
+
+// Measures index_lines on a synthetic source of the given size (default
+// 100 MiB) and checks it against a plain byte loop.
+static std::vector<unsigned int> scalar_index(llvm::StringRef text){
+	std::vector<unsigned int> result;
+	if(text.empty()){ return result; }
+	result.push_back(0);
+	for(std::size_t i = 0; i + 1 < text.size(); ++i){
+		if(text[i] == '\n'){ result.push_back(static_cast<unsigned int>(i + 1)); }
+	}
+	return result;
+}
+
+template <typename Func>
+static double measure(Func func, int iterations){
+	double best = 1e100;
+	for(int i = 0; i < iterations; ++i){
+		const auto begin = std::chrono::steady_clock::now();
+		func();
+		const auto end = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double>(end - begin).count());
+	}
+	return best;
+}
+
+int main(int argc, const char *argv[]){
+	const std::size_t size =
+		argc > 1 ? std::stoull(argv[1]) : (std::size_t(100) << 20);
+	std::mt19937 engine(0);
+	std::uniform_int_distribution<int> length_dist(0, 80);
+	std::string text;
+	text.reserve(size);
+	while(text.size() < size){
+		text.append(length_dist(engine), 'x');
+		text.push_back('\n');
+	}
+	text.resize(size);
+
+	std::vector<unsigned int> kernel_result, scalar_result;
+	const double kernel_time = measure([&](){
+		kernel_result.clear();
+		index_lines(text, kernel_result);
+	}, 5);
+	const double scalar_time = measure([&](){
+		scalar_result = scalar_index(text);
+	}, 5);
+	if(kernel_result != scalar_result){
+		std::cerr << "index_lines disagrees with the scalar loop" << std::endl;
+		return 1;
+	}
+
+	const double megabytes = static_cast<double>(size) / (1 << 20);
+	std::cout << "lines:       " << kernel_result.size() << std::endl;
+	std::cout << "index_lines: " << megabytes / kernel_time << " MiB/s" << std::endl;
+	std::cout << "scalar loop: " << megabytes / scalar_time << " MiB/s" << std::endl;
+	return 0;
+}
@@ -0,0 +1,475 @@
+#include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+#include <clang/Basic/Version.h>
+#include <clang/Driver/Compilation.h>
+#include <clang/Driver/Driver.h>
+#include <clang/Driver/Job.h>
+#include <clang/Driver/Tool.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/PCHContainerOperations.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include "compilation_session.hpp"
+
+// Any symbol in this binary; used to locate the executable
+static int main_executable_anchor;
+
+// Stands for the input filename in cached frontend arguments
+static const char *const input_placeholder = "<input>";
+
+// Remembers the results of status() and the contents of opened files, so
+// that each header is stat'ed and read at most once per process. Sessions
+// on different threads share one instance, so the caches are locked; the
+// underlying file system is accessed without holding the lock.
+class CachingFileSystem : public llvm::vfs::FileSystem {
+
+private:
+	class CachedFile : public llvm::vfs::File {
+	private:
+		llvm::vfs::Status m_status;
+		const llvm::MemoryBuffer *m_buffer;
+	public:
+		CachedFile(llvm::vfs::Status status, const llvm::MemoryBuffer *buffer)
+			: m_status(std::move(status))
+			, m_buffer(buffer)
+		{ }
+		virtual llvm::ErrorOr<llvm::vfs::Status> status() override {
+			return m_status;
+		}
+		virtual llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(
+			const llvm::Twine &name,
+			int64_t,
+			bool requires_null_terminator,
+			bool) override
+		{
+			return llvm::MemoryBuffer::getMemBuffer(
+				m_buffer->getBuffer(), name.str(), requires_null_terminator);
+		}
+		virtual std::error_code close() override {
+			return std::error_code();
+		}
+	};
+
+	struct CachedContent {
+		llvm::vfs::Status status;
+		std::unique_ptr<llvm::MemoryBuffer> buffer;
+	};
+
+	llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> m_base;
+	std::mutex m_mutex;
+	std::unordered_map<std::string, llvm::ErrorOr<llvm::vfs::Status>>
+		m_status_cache;
+	std::unordered_map<std::string, CachedContent> m_content_cache;
+	// Contents handed out before the cache was invalidated
+	std::vector<std::unique_ptr<llvm::MemoryBuffer>> m_retired_buffers;
+
+public:
+	explicit CachingFileSystem(
+		llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> base)
+		: llvm::vfs::FileSystem()
+		, m_base(std::move(base))
+		, m_mutex()
+		, m_status_cache()
+		, m_content_cache()
+		, m_retired_buffers()
+	{ }
+
+	virtual llvm::ErrorOr<llvm::vfs::Status> status(
+		const llvm::Twine &path) override
+	{
+		const auto key = path.str();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const auto it = m_status_cache.find(key);
+			if(it != m_status_cache.end()){ return it->second; }
+		}
+		auto status = m_base->status(key);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_status_cache.emplace(key, std::move(status)).first->second;
+	}
+
+	virtual llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(
+		const llvm::Twine &path) override
+	{
+		const auto key = path.str();
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto it = m_content_cache.find(key);
+		if(it == m_content_cache.end()){
+			lock.unlock();
+			auto file = m_base->openFileForRead(key);
+			if(!file){ return file.getError(); }
+			auto status = (*file)->status();
+			if(!status){ return status.getError(); }
+			auto buffer = (*file)->getBuffer(key);
+			if(!buffer){ return buffer.getError(); }
+			lock.lock();
+			// Another thread may have read the file meanwhile; the first
+			// buffer stored wins.
+			it = m_content_cache.emplace(
+				key, CachedContent{ *status, std::move(*buffer) }).first;
+		}
+		return std::unique_ptr<llvm::vfs::File>(new CachedFile(
+			llvm::vfs::Status::copyWithNewName(it->second.status, key),
+			it->second.buffer.get()));
+	}
+
+	virtual llvm::vfs::directory_iterator dir_begin(
+		const llvm::Twine &dir, std::error_code &ec) override
+	{
+		return m_base->dir_begin(dir, ec);
+	}
+
+	virtual std::error_code setCurrentWorkingDirectory(
+		const llvm::Twine &path) override
+	{
+		// Relative paths are cached as they were given. Buffers are kept
+		// since their contents may still be referred to.
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_status_cache.clear();
+		for(auto &p : m_content_cache){
+			m_retired_buffers.push_back(std::move(p.second.buffer));
+		}
+		m_content_cache.clear();
+		return m_base->setCurrentWorkingDirectory(path);
+	}
+
+	virtual llvm::ErrorOr<std::string> getCurrentWorkingDirectory()
+		const override
+	{
+		return m_base->getCurrentWorkingDirectory();
+	}
+
+	virtual std::error_code getRealPath(
+		const llvm::Twine &path,
+		llvm::SmallVectorImpl<char> &output) const override
+	{
+		return m_base->getRealPath(path, output);
+	}
+
+};
+
+
+// Frontend (cc1) arguments resolved by the driver, with the input filename
+// replaced by a placeholder
+struct CompilationSession::InvocationCache {
+	// Null when the driver failed
+	using Arguments = std::shared_ptr<const std::vector<std::string>>;
+
+	std::mutex mutex;
+	std::string directory;
+	// Published before the driver runs, so that concurrent passes resolving
+	// the same key wait for it instead of running the driver again
+	std::unordered_map<std::string, std::shared_future<Arguments>> arguments;
+};
+
+
+CompilationSession::CompilationSession(
+	const std::string &input_filename,
+	std::unique_ptr<llvm::MemoryBuffer> input_buffer,
+	std::vector<std::string> clang_options)
+	: m_input_filename(clang::tooling::getAbsolutePath(input_filename))
+	, m_input_buffer(std::move(input_buffer))
+	, m_clang_options(std::move(clang_options))
+	, m_resource_directory()
+	, m_file_system()
+	, m_file_manager()
+	, m_invocation_cache(std::make_shared<InvocationCache>())
+{
+	// The builtin headers must match the clang libraries linked into this
+	// binary, so the resource directory is located relative to it.
+	m_resource_directory = clang::CompilerInvocation::GetResourcesPath(
+		"clang_tool", &main_executable_anchor);
+
+	llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> overlay(
+		new llvm::vfs::OverlayFileSystem(
+			new CachingFileSystem(llvm::vfs::getRealFileSystem())));
+	llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> memory(
+		new llvm::vfs::InMemoryFileSystem());
+	overlay->pushOverlay(memory);
+	memory->addFile(
+		m_input_filename, 0,
+		llvm::MemoryBuffer::getMemBuffer(
+			m_input_buffer->getBuffer(), m_input_filename));
+	m_file_system = overlay;
+	m_file_manager =
+		new clang::FileManager(clang::FileSystemOptions(), m_file_system);
+}
+
+CompilationSession::CompilationSession(const CompilationSession &parent, bool)
+	: m_input_filename(parent.m_input_filename)
+	, m_input_buffer(parent.m_input_buffer)
+	, m_clang_options(parent.m_clang_options)
+	, m_resource_directory(parent.m_resource_directory)
+	, m_file_system(parent.m_file_system)
+	, m_file_manager(
+		new clang::FileManager(clang::FileSystemOptions(), m_file_system))
+	, m_invocation_cache(parent.m_invocation_cache)
+{ }
+
+CompilationSession::~CompilationSession() = default;
+
+std::unique_ptr<CompilationSession> CompilationSession::fork() const {
+	return std::unique_ptr<CompilationSession>(
+		new CompilationSession(*this, true));
+}
+
+void CompilationSession::set_invocation_cache(std::string directory){
+	std::lock_guard<std::mutex> lock(m_invocation_cache->mutex);
+	m_invocation_cache->directory = std::move(directory);
+}
+
+bool CompilationSession::file_contents(
+	const clang::FileEntry *entry,
+	llvm::StringRef &text)
+{
+	// The buffer returned refers to memory owned by the file systems
+	const auto buffer = m_file_manager->getBufferForFile(entry);
+	if(!buffer){ return false; }
+	text = (*buffer)->getBuffer();
+	return true;
+}
+
+bool CompilationSession::run(
+	clang::tooling::ToolAction &action,
+	const std::vector<std::string> &extra_options,
+	clang::DiagnosticConsumer *diag_consumer)
+{
+	return run(m_input_filename, action, extra_options, diag_consumer);
+}
+
+bool CompilationSession::run(
+	const std::string &filename,
+	clang::tooling::ToolAction &action,
+	const std::vector<std::string> &extra_options,
+	clang::DiagnosticConsumer *diag_consumer)
+{
+	llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> diag_options(
+		new clang::DiagnosticOptions());
+	clang::TextDiagnosticPrinter diag_printer(llvm::errs(), &*diag_options);
+	clang::DiagnosticsEngine diagnostics(
+		new clang::DiagnosticIDs(), &*diag_options,
+		diag_consumer ? diag_consumer : &diag_printer, false);
+
+	std::vector<std::string> arguments;
+	if(!frontend_arguments(filename, extra_options, diagnostics, arguments)){
+		return false;
+	}
+	std::vector<const char *> argv;
+	for(const auto &s : arguments){ argv.push_back(s.c_str()); }
+	auto invocation = std::make_shared<clang::CompilerInvocation>();
+	if(!clang::CompilerInvocation::CreateFromArgs(
+		*invocation, argv.data(), argv.data() + argv.size(), diagnostics))
+	{
+		return false;
+	}
+	invocation->getFrontendOpts().DisableFree = false;
+	invocation->getCodeGenOpts().DisableFree = false;
+
+	return action.runInvocation(
+		std::move(invocation), m_file_manager.get(),
+		std::make_shared<clang::PCHContainerOperations>(), diag_consumer);
+}
+
+static std::string invocation_key(
+	const std::vector<std::string> &clang_options,
+	const std::vector<std::string> &extra_options,
+	const std::string &filename)
+{
+	llvm::MD5 hash;
+	const auto update = [&hash](llvm::StringRef s){
+		hash.update(s);
+		hash.update(llvm::StringRef("\n"));
+	};
+	update(clang::getClangFullVersion());
+	update(llvm::sys::fs::getMainExecutable(
+		"clang_tool", &main_executable_anchor));
+	llvm::SmallString<256> working_directory;
+	if(!llvm::sys::fs::current_path(working_directory)){
+		update(working_directory);
+	}
+	for(const auto &s : clang_options){ update(s); }
+	update("");
+	for(const auto &s : extra_options){ update(s); }
+	update("");
+	// The driver picks the input language from the extension
+	update(llvm::sys::path::extension(filename));
+	llvm::MD5::MD5Result result;
+	hash.final(result);
+	return result.digest().str().str();
+}
+
+bool CompilationSession::frontend_arguments(
+	const std::string &filename,
+	const std::vector<std::string> &extra_options,
+	clang::DiagnosticsEngine &diagnostics,
+	std::vector<std::string> &arguments)
+{
+	const auto key = invocation_key(m_clang_options, extra_options, filename);
+	auto &cache = *m_invocation_cache;
+	std::unique_lock<std::mutex> lock(cache.mutex);
+	const auto directory = cache.directory;
+	const auto resolve = [&]() -> InvocationCache::Arguments {
+		std::string path;
+		if(!directory.empty()){
+			llvm::SmallString<256> base_path(directory);
+			llvm::sys::fs::make_absolute(base_path);
+			llvm::sys::path::append(base_path, key + ".args");
+			path = base_path.str().str();
+		}
+		auto resolved = std::make_shared<std::vector<std::string>>();
+		if(path.empty() || !load_invocation(path, *resolved)){
+			if(!run_driver(filename, extra_options, diagnostics, *resolved)){
+				return InvocationCache::Arguments();
+			}
+			for(auto &s : *resolved){
+				if(s == filename){ s = input_placeholder; }
+			}
+			if(!path.empty()){ store_invocation(directory, path, *resolved); }
+		}
+		return InvocationCache::Arguments(std::move(resolved));
+	};
+
+	InvocationCache::Arguments resolved;
+	const auto it = cache.arguments.find(key);
+	if(it != cache.arguments.end()){
+		const auto pending = it->second;
+		lock.unlock();
+		resolved = pending.get();
+		// A failure is repeated so that its diagnostics reach this pass too
+		if(!resolved){ resolved = resolve(); }
+	}else{
+		std::promise<InvocationCache::Arguments> promise;
+		cache.arguments.emplace(key, promise.get_future().share());
+		lock.unlock();
+		resolved = resolve();
+		if(!resolved){
+			// Later passes try again instead of waiting on the failure
+			lock.lock();
+			cache.arguments.erase(key);
+			lock.unlock();
+		}
+		promise.set_value(resolved);
+	}
+	if(!resolved){ return false; }
+	arguments = *resolved;
+
+	for(std::size_t i = 0; i < arguments.size(); ++i){
+		if(arguments[i] == input_placeholder){
+			arguments[i] = filename;
+		}else if(arguments[i] == "-main-file-name"){
+			if(i + 1 < arguments.size()){
+				arguments[++i] = llvm::sys::path::filename(filename).str();
+			}
+		}
+	}
+	return true;
+}
+
+bool CompilationSession::run_driver(
+	const std::string &filename,
+	const std::vector<std::string> &extra_options,
+	clang::DiagnosticsEngine &diagnostics,
+	std::vector<std::string> &arguments)
+{
+	std::vector<std::string> command_line;
+	command_line.push_back("clang-tool");
+	command_line.insert(
+		command_line.end(), m_clang_options.begin(), m_clang_options.end());
+	command_line.insert(
+		command_line.end(), extra_options.begin(), extra_options.end());
+	command_line.push_back("-fsyntax-only");
+	command_line.push_back("-resource-dir=" + m_resource_directory);
+	command_line.push_back(filename);
+	std::vector<const char *> argv;
+	for(const auto &s : command_line){ argv.push_back(s.c_str()); }
+
+	clang::driver::Driver driver(
+		argv[0], llvm::sys::getDefaultTargetTriple(), diagnostics,
+		m_file_manager->getVirtualFileSystem());
+	// The input may only exist in the in-memory file system
+	driver.setCheckInputsExist(false);
+	const std::unique_ptr<clang::driver::Compilation> compilation(
+		driver.BuildCompilation(argv));
+	if(!compilation){ return false; }
+
+	// -fsyntax-only yields exactly one frontend job
+	const auto &jobs = compilation->getJobs();
+	if(jobs.size() != 1){ return false; }
+	const auto &job = *jobs.begin();
+	if(!llvm::isa<clang::driver::Command>(job)){ return false; }
+	const auto &command = llvm::cast<clang::driver::Command>(job);
+	if(llvm::StringRef(command.getCreator().getName()) != "clang"){
+		return false;
+	}
+	// The leading -cc1 is not part of the frontend arguments
+	const auto &command_arguments = command.getArguments();
+	arguments.assign(command_arguments.begin(), command_arguments.end());
+	if(!arguments.empty() && arguments.front() == "-cc1"){
+		arguments.erase(arguments.begin());
+	}
+	return true;
+}
+
+bool CompilationSession::load_invocation(
+	const std::string &path,
+	std::vector<std::string> &arguments)
+{
+	std::ifstream ifs(path.c_str());
+	if(!ifs){ return false; }
+	arguments.clear();
+	std::string line;
+	while(std::getline(ifs, line)){ arguments.push_back(line); }
+	if(arguments.empty()){ return false; }
+	// The detected toolchain may have been upgraded or removed since
+	for(std::size_t i = 0; i + 1 < arguments.size(); ++i){
+		const auto &s = arguments[i];
+		if(
+			s == "-resource-dir" ||
+			s == "-internal-isystem" ||
+			s == "-internal-externc-isystem")
+		{
+			if(!m_file_manager->getDirectory(arguments[i + 1])){ return false; }
+		}
+	}
+	return true;
+}
+
+void CompilationSession::store_invocation(
+	const std::string &directory,
+	const std::string &path,
+	const std::vector<std::string> &arguments)
+{
+	for(const auto &s : arguments){
+		if(s.find('\n') != std::string::npos){ return; }
+	}
+	if(llvm::sys::fs::create_directories(directory)){
+		return;
+	}
+	// Written to a unique file first; other processes may read concurrently
+	int fd = -1;
+	llvm::SmallString<256> temporary_path;
+	if(llvm::sys::fs::createUniqueFile(path + "-%%%%%%", fd, temporary_path)){
+		return;
+	}
+	bool succeeded = false;
+	{
+		llvm::raw_fd_ostream os(fd, true);
+		for(const auto &s : arguments){ os << s << "\n"; }
+		os.close();
+		succeeded = !os.has_error();
+		os.clear_error();
+	}
+	if(!succeeded || llvm::sys::fs::rename(temporary_path, path)){
+		llvm::sys::fs::remove(temporary_path);
+	}
+}
@@ -0,0 +1,107 @@
+#ifndef CPP_SIMPLIFIER_COMPILATION_SESSION_HPP
+#define CPP_SIMPLIFIER_COMPILATION_SESSION_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Tooling/Tooling.h>
+
+// State shared by all passes over one input: the options, the input text
+// mapped into an in-memory file system, and a FileManager whose stat
+// results and file contents are reused from pass to pass. The driver runs
+// at most once per distinct command line; passes after that build their
+// CompilerInvocation directly from the resolved frontend arguments.
+//
+// A session must be used from one thread at a time. fork() makes another
+// session for a concurrent pass; the two share the file cache and the
+// resolved arguments but not the FileManager.
+class CompilationSession {
+
+private:
+	struct InvocationCache;
+
+	std::string m_input_filename;
+	std::shared_ptr<const llvm::MemoryBuffer> m_input_buffer;
+	std::vector<std::string> m_clang_options;
+	std::string m_resource_directory;
+	llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> m_file_system;
+	llvm::IntrusiveRefCntPtr<clang::FileManager> m_file_manager;
+	std::shared_ptr<InvocationCache> m_invocation_cache;
+
+	CompilationSession(const CompilationSession &parent, bool);
+
+public:
+	CompilationSession(
+		const std::string &input_filename,
+		std::unique_ptr<llvm::MemoryBuffer> input_buffer,
+		std::vector<std::string> clang_options);
+
+	CompilationSession(const CompilationSession &) = delete;
+	CompilationSession &operator=(const CompilationSession &) = delete;
+	~CompilationSession();
+
+	// Makes a session for passes running concurrently with this one.
+	std::unique_ptr<CompilationSession> fork() const;
+
+	const std::string &input_filename() const { return m_input_filename; }
+	llvm::StringRef input_source() const {
+		return m_input_buffer->getBuffer();
+	}
+	const std::vector<std::string> &clang_options() const {
+		return m_clang_options;
+	}
+	clang::FileManager &file_manager(){ return *m_file_manager; }
+
+	// Contents of a file as read by the passes. The text stays valid for
+	// the lifetime of the session.
+	bool file_contents(const clang::FileEntry *entry, llvm::StringRef &text);
+
+	// Stores the frontend arguments resolved by the driver under directory,
+	// so that later processes can skip toolchain detection.
+	void set_invocation_cache(std::string directory);
+
+	// Runs action on the input. Diagnostics go to diag_consumer, or are
+	// printed to stderr when it is null.
+	bool run(
+		clang::tooling::ToolAction &action,
+		const std::vector<std::string> &extra_options,
+		clang::DiagnosticConsumer *diag_consumer = nullptr);
+
+	// Runs action on another file with the same options.
+	bool run(
+		const std::string &filename,
+		clang::tooling::ToolAction &action,
+		const std::vector<std::string> &extra_options,
+		clang::DiagnosticConsumer *diag_consumer = nullptr);
+
+private:
+	bool frontend_arguments(
+		const std::string &filename,
+		const std::vector<std::string> &extra_options,
+		clang::DiagnosticsEngine &diagnostics,
+		std::vector<std::string> &arguments);
+
+	bool run_driver(
+		const std::string &filename,
+		const std::vector<std::string> &extra_options,
+		clang::DiagnosticsEngine &diagnostics,
+		std::vector<std::string> &arguments);
+
+	bool load_invocation(
+		const std::string &path,
+		std::vector<std::string> &arguments);
+
+	void store_invocation(
+		const std::string &directory,
+		const std::string &path,
+		const std::vector<std::string> &arguments);
+
+};
+
+#endif
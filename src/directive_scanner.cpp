@@ -0,0 +1,603 @@
+#include <stdexcept>
+#include <set>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <unordered_map>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/LangOptions.h>
+#include <clang/Lex/Lexer.h>
+#include "directive_scanner.hpp"
+#include "compilation_session.hpp"
+
+struct RawToken {
+	clang::Token token;
+	const char *begin;
+	const char *end() const { return begin + token.getLength(); }
+};
+
+struct KnownMacro {
+	bool defined;
+	bool function_like;
+	std::string body;
+};
+
+using KnownMacroTable = std::unordered_map<std::string, KnownMacro>;
+
+static bool parse_integer(llvm::StringRef text, long long &value){
+	text = text.trim().rtrim("uUlL");
+	if(text.empty()){ return false; }
+	for(const auto c : text){
+		if(!isalnum(static_cast<unsigned char>(c))){ return false; }
+	}
+	try{
+		std::size_t length = 0;
+		value = std::stoll(text.str(), &length, 0);
+		return length == text.size();
+	}catch(const std::logic_error &){
+		return false;
+	}
+}
+
+
+// Evaluates the controlling expression of #if and #elif. Only integer
+// literals, defined and macros with known values are accepted; anything
+// else makes the evaluation fail.
+class ConditionEvaluator {
+
+private:
+	const std::vector<RawToken> &m_tokens;
+	std::size_t m_position;
+	const KnownMacroTable &m_macros;
+	bool m_failed;
+
+public:
+	ConditionEvaluator(
+		const std::vector<RawToken> &tokens,
+		std::size_t begin,
+		const KnownMacroTable &macros)
+		: m_tokens(tokens)
+		, m_position(begin)
+		, m_macros(macros)
+		, m_failed(false)
+	{ }
+
+	bool evaluate(bool &result){
+		const auto value = parse_or();
+		if(m_failed || m_position != m_tokens.size()){ return false; }
+		result = (value != 0);
+		return true;
+	}
+
+private:
+	long long fail(){
+		m_failed = true;
+		m_position = m_tokens.size();
+		return 0;
+	}
+
+	bool accept(clang::tok::TokenKind kind){
+		if(m_position >= m_tokens.size()){ return false; }
+		if(!m_tokens[m_position].token.is(kind)){ return false; }
+		++m_position;
+		return true;
+	}
+
+	long long parse_or(){
+		auto value = parse_and();
+		while(accept(clang::tok::pipepipe)){
+			const auto rhs = parse_and();
+			value = (value || rhs);
+		}
+		return value;
+	}
+
+	long long parse_and(){
+		auto value = parse_equality();
+		while(accept(clang::tok::ampamp)){
+			const auto rhs = parse_equality();
+			value = (value && rhs);
+		}
+		return value;
+	}
+
+	long long parse_equality(){
+		auto value = parse_relational();
+		for(;;){
+			if(accept(clang::tok::equalequal)){
+				value = (value == parse_relational());
+			}else if(accept(clang::tok::exclaimequal)){
+				value = (value != parse_relational());
+			}else{
+				return value;
+			}
+		}
+	}
+
+	long long parse_relational(){
+		auto value = parse_additive();
+		for(;;){
+			if(accept(clang::tok::less)){
+				value = (value < parse_additive());
+			}else if(accept(clang::tok::greater)){
+				value = (value > parse_additive());
+			}else if(accept(clang::tok::lessequal)){
+				value = (value <= parse_additive());
+			}else if(accept(clang::tok::greaterequal)){
+				value = (value >= parse_additive());
+			}else{
+				return value;
+			}
+		}
+	}
+
+	long long parse_additive(){
+		auto value = parse_unary();
+		for(;;){
+			if(accept(clang::tok::plus)){
+				value += parse_unary();
+			}else if(accept(clang::tok::minus)){
+				value -= parse_unary();
+			}else{
+				return value;
+			}
+		}
+	}
+
+	long long parse_unary(){
+		if(accept(clang::tok::exclaim)){ return !parse_unary(); }
+		if(accept(clang::tok::minus)){ return -parse_unary(); }
+		if(accept(clang::tok::plus)){ return parse_unary(); }
+		return parse_primary();
+	}
+
+	long long parse_primary(){
+		if(m_position >= m_tokens.size()){ return fail(); }
+		const auto &tok = m_tokens[m_position];
+		if(accept(clang::tok::l_paren)){
+			const auto value = parse_or();
+			if(!accept(clang::tok::r_paren)){ return fail(); }
+			return value;
+		}
+		if(tok.token.is(clang::tok::numeric_constant)){
+			++m_position;
+			const llvm::StringRef spelling(tok.begin, tok.token.getLength());
+			long long value = 0;
+			if(!parse_integer(spelling, value)){ return fail(); }
+			return value;
+		}
+		if(!tok.token.is(clang::tok::raw_identifier)){ return fail(); }
+		++m_position;
+		const auto name = tok.token.getRawIdentifier();
+		if(name == "true"){ return 1; }
+		if(name == "false"){ return 0; }
+		if(name == "defined"){
+			const bool parenthesized = accept(clang::tok::l_paren);
+			if(m_position >= m_tokens.size()){ return fail(); }
+			const auto &operand = m_tokens[m_position].token;
+			if(!operand.is(clang::tok::raw_identifier)){ return fail(); }
+			++m_position;
+			if(parenthesized && !accept(clang::tok::r_paren)){ return fail(); }
+			const auto it = m_macros.find(operand.getRawIdentifier().str());
+			if(it == m_macros.end()){ return fail(); }
+			return it->second.defined ? 1 : 0;
+		}
+		const auto it = m_macros.find(name.str());
+		if(it == m_macros.end()){ return fail(); }
+		if(!it->second.defined){ return 0; }
+		long long value = 0;
+		if(it->second.function_like || !parse_integer(it->second.body, value)){
+			return fail();
+		}
+		return value;
+	}
+
+};
+
+
+class DirectiveScanner {
+
+private:
+	// Same limit as the preprocessor's default
+	static const unsigned int max_inclusion_depth = 200;
+
+	struct Conditional {
+		bool parent_active;
+		bool current;
+		bool taken;
+		bool seen_else;
+	};
+
+	struct FileState {
+		const clang::FileEntry *entry;
+		std::string filename;
+		unsigned int source_index;
+		std::vector<Conditional> conditionals;
+		bool seen_directive;
+		bool seen_tokens;
+		// Name tested by a leading #ifndef that must be #define'd next
+		std::string pending_guard;
+
+		bool active() const {
+			return conditionals.empty() || (
+				conditionals.back().parent_active &&
+				conditionals.back().current);
+		}
+	};
+
+	CompilationSession &m_session;
+	clang::LangOptions m_lang_options;
+	std::vector<std::string> m_include_paths;
+	// Macros whose state does not depend on angled headers
+	KnownMacroTable m_macros;
+
+	UnrolledSource m_result;
+	std::unordered_map<std::string, unsigned int> m_source_indices;
+	// Keyed by file identity, since the name of a FileEntry is the one it
+	// was last looked up by
+	std::set<llvm::sys::fs::UniqueID> m_once_files;
+	std::unordered_set<std::string> m_angled_inclusions;
+	int m_last_source;
+	int m_last_line;
+
+public:
+	explicit DirectiveScanner(CompilationSession &session)
+		: m_session(session)
+		, m_lang_options()
+		, m_include_paths()
+		, m_macros()
+		, m_result()
+		, m_source_indices()
+		, m_once_files()
+		, m_angled_inclusions()
+		, m_last_source(-1)
+		, m_last_line(-1)
+	{
+		m_lang_options.CPlusPlus = 1;
+		m_lang_options.LineComment = 1;
+		m_lang_options.Digraphs = 1;
+		m_lang_options.Bool = 1;
+		// clang defaults to gnu++14
+		set_standard_version(14);
+		for(const auto &s : session.clang_options()){
+			if(s.compare(0, 2, "-I") == 0){
+				m_include_paths.push_back(s.substr(2));
+			}else if(s.compare(0, 2, "-D") == 0){
+				define_from_command_line(s.substr(2));
+			}else if(s.compare(0, 5, "-std=") == 0){
+				set_standard(s.substr(5));
+			}
+		}
+	}
+
+	bool scan(UnrolledSource &result){
+		const auto entry =
+			m_session.file_manager().getFile(m_session.input_filename());
+		if(!entry){ return false; }
+		if(!scan_file(entry, 0)){ return false; }
+		result = std::move(m_result);
+		return true;
+	}
+
+private:
+	void set_standard_version(int version){
+		m_lang_options.CPlusPlus11 = (version >= 11);
+		m_lang_options.CPlusPlus14 = (version >= 14);
+		m_lang_options.CPlusPlus17 = (version >= 17);
+		m_lang_options.CPlusPlus2a = (version >= 20);
+	}
+
+	void set_standard(const std::string &standard){
+		const auto pos = standard.find("++");
+		if(pos == std::string::npos){ return; }
+		const auto version = standard.substr(pos + 2);
+		if(version == "98" || version == "03"){
+			set_standard_version(3);
+		}else if(version == "0x" || version == "11"){
+			set_standard_version(11);
+		}else if(version == "1y" || version == "14"){
+			set_standard_version(14);
+		}else if(version == "1z" || version == "17"){
+			set_standard_version(17);
+		}else{
+			set_standard_version(20);
+		}
+	}
+
+	void define_from_command_line(const std::string &definition){
+		const auto equal = definition.find('=');
+		auto name = definition.substr(0, equal);
+		KnownMacro macro{ true, false, "1" };
+		if(equal != std::string::npos){
+			macro.body = definition.substr(equal + 1);
+		}
+		const auto paren = name.find('(');
+		if(paren != std::string::npos){
+			macro.function_like = true;
+			name = name.substr(0, paren);
+		}
+		m_macros[name] = macro;
+	}
+
+	unsigned int find_or_add_source(
+		const std::string &filename,
+		llvm::StringRef text)
+	{
+		const auto it = m_source_indices.find(filename);
+		if(it != m_source_indices.end()){ return it->second; }
+		const unsigned int index = m_result.sources.size();
+		m_result.sources.emplace_back(filename, text);
+		m_source_indices.emplace(filename, index);
+		return index;
+	}
+
+	void record_line(unsigned int source, int line){
+		if(static_cast<int>(source) != m_last_source || line != m_last_line){
+			m_result.lines.push_back(UnrolledSource::Line{
+				source, static_cast<unsigned int>(line)});
+		}
+		m_last_source = source;
+		m_last_line = line;
+	}
+
+	// Looks up a quoted inclusion the way the preprocessor does: next to
+	// the including file, then in the -I directories. Files only reachable
+	// through system directories are not resolved.
+	const clang::FileEntry *lookup_quoted(
+		const std::string &includer,
+		const std::string &name)
+	{
+		auto &fm = m_session.file_manager();
+		if(llvm::sys::path::is_absolute(name)){ return fm.getFile(name); }
+		std::string directory = llvm::sys::path::parent_path(includer).str();
+		if(directory.empty()){ directory = "."; }
+		if(const auto entry = fm.getFile(directory + "/" + name)){
+			return entry;
+		}
+		for(const auto &s : m_include_paths){
+			llvm::SmallString<256> path(s);
+			llvm::sys::path::append(path, name);
+			if(const auto entry = fm.getFile(path)){ return entry; }
+		}
+		return nullptr;
+	}
+
+	bool scan_file(const clang::FileEntry *entry, unsigned int depth){
+		if(depth >= max_inclusion_depth){ return false; }
+		if(m_once_files.count(entry->getUniqueID())){ return true; }
+		FileState state;
+		state.entry = entry;
+		state.filename = entry->getName().str();
+		llvm::StringRef text;
+		if(!m_session.file_contents(entry, text)){ return false; }
+		state.source_index = find_or_add_source(state.filename, text);
+		state.seen_directive = false;
+		state.seen_tokens = false;
+
+		// Tokens come in order, so the line only ever moves forward.
+		// Nested inclusions may add sources, hence the lookup by index.
+		int current_line = 0;
+		const auto line_of = [&](const char *p){
+			const auto &line_starts =
+				m_result.sources[state.source_index].line_starts;
+			const std::size_t offset = p - text.begin();
+			while(
+				current_line + 1 < static_cast<int>(line_starts.size()) &&
+				line_starts[current_line + 1] <= offset)
+			{
+				++current_line;
+			}
+			return current_line;
+		};
+
+		clang::Lexer lexer(
+			clang::SourceLocation(), m_lang_options,
+			text.begin(), text.begin(), text.end());
+		const auto next = [&lexer](RawToken &t){
+			lexer.LexFromRawLexer(t.token);
+			t.begin = lexer.getBufferLocation() - t.token.getLength();
+		};
+
+		RawToken tok;
+		next(tok);
+		while(!tok.token.is(clang::tok::eof)){
+			if(tok.token.is(clang::tok::hash) && tok.token.isAtStartOfLine()){
+				std::vector<RawToken> directive;
+				next(tok);
+				while(
+					!tok.token.is(clang::tok::eof) &&
+					!tok.token.isAtStartOfLine())
+				{
+					directive.push_back(tok);
+					next(tok);
+				}
+				if(!handle_directive(state, directive, depth)){ return false; }
+				continue;
+			}
+			if(state.active()){
+				state.seen_tokens = true;
+				record_line(state.source_index, line_of(tok.begin));
+			}
+			next(tok);
+		}
+		return state.conditionals.empty() && state.pending_guard.empty();
+	}
+
+	bool handle_directive(
+		FileState &state,
+		const std::vector<RawToken> &directive,
+		unsigned int depth)
+	{
+		if(directive.empty()){ return true; }
+		const bool active = state.active();
+		const auto &head = directive.front().token;
+		// Line markers and the like
+		if(!head.is(clang::tok::raw_identifier)){ return !active; }
+		const auto name = head.getRawIdentifier();
+
+		const bool first_directive = !state.seen_directive;
+		state.seen_directive = true;
+		if(active && !state.pending_guard.empty()){
+			if(name != "define" || directive.size() < 2){ return false; }
+			const auto &macro = directive[1].token;
+			if(!macro.is(clang::tok::raw_identifier)){ return false; }
+			if(macro.getRawIdentifier() != state.pending_guard){ return false; }
+			state.pending_guard.clear();
+		}
+
+		if(name == "if" || name == "ifdef" || name == "ifndef"){
+			Conditional cond{ active, false, false, false };
+			if(active){
+				bool value = false;
+				if(name == "if"){
+					ConditionEvaluator evaluator(directive, 1, m_macros);
+					if(!evaluator.evaluate(value)){ return false; }
+				}else{
+					if(directive.size() < 2){ return false; }
+					const auto &macro = directive[1].token;
+					if(!macro.is(clang::tok::raw_identifier)){ return false; }
+					const auto macro_name = macro.getRawIdentifier().str();
+					const auto it = m_macros.find(macro_name);
+					bool defined = false;
+					if(it != m_macros.end()){
+						defined = it->second.defined;
+					}else if(
+						name == "ifndef" && first_directive &&
+						!state.seen_tokens)
+					{
+						// Include guard; it is confirmed by the next directive
+						state.pending_guard = macro_name;
+					}else{
+						return false;
+					}
+					value = (defined == (name == "ifdef"));
+				}
+				cond.current = cond.taken = value;
+			}
+			state.conditionals.push_back(cond);
+			return true;
+		}
+		if(name == "elif"){
+			if(state.conditionals.empty()){ return false; }
+			auto &cond = state.conditionals.back();
+			if(cond.seen_else){ return false; }
+			if(!cond.parent_active || cond.taken){
+				cond.current = false;
+				return true;
+			}
+			bool value = false;
+			ConditionEvaluator evaluator(directive, 1, m_macros);
+			if(!evaluator.evaluate(value)){ return false; }
+			cond.current = cond.taken = value;
+			return true;
+		}
+		if(name == "else"){
+			if(state.conditionals.empty()){ return false; }
+			auto &cond = state.conditionals.back();
+			if(cond.seen_else){ return false; }
+			cond.seen_else = true;
+			cond.current = !cond.taken;
+			cond.taken = true;
+			return true;
+		}
+		if(name == "endif"){
+			if(state.conditionals.empty()){ return false; }
+			state.conditionals.pop_back();
+			return true;
+		}
+
+		if(!active){ return true; }
+		if(name == "define"){ return handle_define(directive); }
+		if(name == "undef"){
+			if(directive.size() < 2){ return false; }
+			const auto &macro = directive[1].token;
+			if(!macro.is(clang::tok::raw_identifier)){ return false; }
+			m_macros[macro.getRawIdentifier().str()] =
+				KnownMacro{ false, false, "" };
+			return true;
+		}
+		if(name == "include"){ return handle_include(state, directive, depth); }
+		if(name == "pragma"){
+			if(directive.size() < 2){ return true; }
+			const auto &arg = directive[1].token;
+			if(!arg.is(clang::tok::raw_identifier)){ return true; }
+			const auto pragma = arg.getRawIdentifier();
+			if(pragma == "once"){
+				m_once_files.insert(state.entry->getUniqueID());
+			}else if(pragma == "push_macro" || pragma == "pop_macro"){
+				return false;
+			}
+			return true;
+		}
+		if(name == "warning" || name == "ident" || name == "sccs"){
+			return true;
+		}
+		// #error, #line, #include_next, #import and unknown directives
+		return false;
+	}
+
+	bool handle_define(const std::vector<RawToken> &directive){
+		if(directive.size() < 2){ return false; }
+		const auto &name = directive[1].token;
+		if(!name.is(clang::tok::raw_identifier)){ return false; }
+		KnownMacro macro{ true, false, "" };
+		std::size_t body_begin = 2;
+		if(
+			body_begin < directive.size() &&
+			directive[body_begin].token.is(clang::tok::l_paren) &&
+			!directive[body_begin].token.hasLeadingSpace())
+		{
+			macro.function_like = true;
+			while(
+				body_begin < directive.size() &&
+				!directive[body_begin].token.is(clang::tok::r_paren))
+			{
+				++body_begin;
+			}
+			++body_begin;
+		}
+		if(body_begin < directive.size()){
+			macro.body.assign(
+				directive[body_begin].begin, directive.back().end());
+		}
+		m_macros[name.getRawIdentifier().str()] = macro;
+		return true;
+	}
+
+	bool handle_include(
+		FileState &state,
+		const std::vector<RawToken> &directive,
+		unsigned int depth)
+	{
+		if(directive.size() < 2){ return false; }
+		const std::string spelling(directive[1].begin, directive.back().end());
+		if(spelling.size() < 2){ return false; }
+		if(spelling.front() == '<' && spelling.back() == '>'){
+			// Hoisted in the order they first appear
+			const auto name = spelling.substr(1, spelling.size() - 2);
+			if(m_angled_inclusions.insert(name).second){
+				m_result.angled_inclusions.push_back(name);
+			}
+			return true;
+		}
+		// Computed inclusions depend on macros
+		if(directive.size() != 2){ return false; }
+		if(!directive[1].token.is(clang::tok::string_literal)){ return false; }
+		const auto name = spelling.substr(1, spelling.size() - 2);
+		if(name.find('\\') != std::string::npos){ return false; }
+		const auto entry = lookup_quoted(state.filename, name);
+		if(!entry){ return false; }
+		return scan_file(entry, depth + 1);
+	}
+
+};
+
+
+bool scan_directives(CompilationSession &session, UnrolledSource &result){
+	DirectiveScanner scanner(session);
+	return scanner.scan(result);
+}
@@ -0,0 +1,15 @@
+#ifndef CPP_SIMPLIFIER_DIRECTIVE_SCANNER_HPP
+#define CPP_SIMPLIFIER_DIRECTIVE_SCANNER_HPP
+
+#include "inclusion_unroller.hpp"
+
+class CompilationSession;
+
+// Unrolls quoted inclusions without running the preprocessor: only quoted
+// files are lexed (in raw mode) and angled headers are never opened.
+// Returns false, leaving result unspecified, when the outcome could depend
+// on anything the scanner does not track, such as macros that may come
+// from angled headers. The caller must then fall back to the preprocessor.
+bool scan_directives(CompilationSession &session, UnrolledSource &result);
+
+#endif
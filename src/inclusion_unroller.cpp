@@ -1,15 +1,21 @@
+#include <algorithm>
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <limits>
+#include <stdexcept>
 #include <unordered_set>
 #include <unordered_map>
+#include <clang/Basic/Diagnostic.h>
 #include <clang/Basic/FileManager.h>
 #include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Tooling/Tooling.h>
-#include <clang/Tooling/CompilationDatabase.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/MacroInfo.h>
 #include <clang/Lex/Preprocessor.h>
 #include "inclusion_unroller.hpp"
+#include "line_index.hpp"
+#include "directive_scanner.hpp"
+#include "compilation_session.hpp"
 
 class InclusionUnrollingAction
 	: public clang::PreprocessorFrontendAction
@@ -26,11 +32,11 @@ private:
 		{ }
 		virtual void FileChanged(
 			clang::SourceLocation loc,
-			FileChangeReason,
+			FileChangeReason reason,
 			clang::SrcMgr::CharacteristicKind,
 			clang::FileID) override
 		{
-			m_action->OnFileChanged(loc);
+			m_action->OnFileChanged(loc, reason);
 		}
 		virtual void InclusionDirective(
 			clang::SourceLocation hash_loc,
@@ -47,32 +53,107 @@ private:
 			m_action->OnInclusionDirective(
 				hash_loc, filename, is_angled, file);
 		}
+		virtual void If(
+			clang::SourceLocation,
+			clang::SourceRange condition_range,
+			ConditionValueKind) override
+		{
+			m_action->OnCondition(condition_range);
+		}
+		virtual void Elif(
+			clang::SourceLocation,
+			clang::SourceRange condition_range,
+			ConditionValueKind condition_value,
+			clang::SourceLocation) override
+		{
+			if(condition_value != CVK_NotEvaluated){
+				m_action->OnCondition(condition_range);
+			}else{
+				m_action->OnDirective();
+			}
+		}
+		virtual void Ifdef(
+			clang::SourceLocation,
+			const clang::Token &macro_name,
+			const clang::MacroDefinition &definition) override
+		{
+			m_action->OnMacroTest(macro_name, definition, false);
+		}
+		virtual void Ifndef(
+			clang::SourceLocation,
+			const clang::Token &macro_name,
+			const clang::MacroDefinition &definition) override
+		{
+			m_action->OnMacroTest(macro_name, definition, true);
+		}
+		virtual void Else(clang::SourceLocation, clang::SourceLocation) override {
+			m_action->OnDirective();
+		}
+		virtual void Endif(clang::SourceLocation, clang::SourceLocation) override {
+			m_action->OnDirective();
+		}
+		virtual void MacroDefined(
+			const clang::Token &macro_name,
+			const clang::MacroDirective *) override
+		{
+			m_action->OnMacroDefined(macro_name, true);
+		}
+		virtual void MacroUndefined(
+			const clang::Token &macro_name,
+			const clang::MacroDefinition &,
+			const clang::MacroDirective *) override
+		{
+			m_action->OnMacroDefined(macro_name, false);
+		}
 	};
 
-	std::shared_ptr<std::string> m_result_ptr;
-	std::string m_input_content;
-	std::string m_input_filename;
+	std::shared_ptr<UnrolledSource> m_result_ptr;
+	CompilationSession &m_session;
+	bool m_skip_angled_headers;
 
 	clang::SourceManager *m_current_source_manager;
+	clang::Preprocessor *m_current_preprocessor;
 
-	std::unordered_map<std::string, std::vector<std::string>> m_source_cache;
-	std::vector<std::string> *m_current_source;
+	UnrolledSource m_result;
+	std::unordered_map<std::string, unsigned int> m_source_indices;
+	int m_current_source;
+	// Range of the current file in the source location space
+	unsigned int m_current_begin;
+	unsigned int m_current_end;
 
 	std::unordered_set<std::string> m_angled_inclusions;
 
+	// Angled header to be skipped when the preprocessor enters it
+	const clang::FileEntry *m_pending_skip;
+	bool m_skipped_any;
+	// Cleared when a quoted file tests a macro that a skipped header
+	// might have defined
+	bool m_consistent;
+	std::unordered_set<std::string> m_undefined_macros;
+	std::string m_pending_guard;
+
 public:
 	InclusionUnrollingAction(
-		std::shared_ptr<std::string> result_ptr,
-		std::string input_content,
-		std::string input_filename)
+		std::shared_ptr<UnrolledSource> result_ptr,
+		CompilationSession &session,
+		bool skip_angled_headers)
 		: clang::PreprocessorFrontendAction()
 		, m_result_ptr(std::move(result_ptr))
-		, m_input_content(std::move(input_content))
-		, m_input_filename(std::move(input_filename))
+		, m_session(session)
+		, m_skip_angled_headers(skip_angled_headers)
 		, m_current_source_manager()
-		, m_source_cache()
-		, m_current_source()
+		, m_current_preprocessor()
+		, m_result()
+		, m_source_indices()
+		, m_current_source(-1)
+		, m_current_begin(0)
+		, m_current_end(0)
 		, m_angled_inclusions()
+		, m_pending_skip()
+		, m_skipped_any(false)
+		, m_consistent(true)
+		, m_undefined_macros()
+		, m_pending_guard()
 	{ }
 
 	virtual void ExecuteAction() override {
@@ -80,74 +161,197 @@ public:
 		auto &pp = ci.getPreprocessor();
 		auto &sm = ci.getSourceManager();
 		m_current_source_manager = &sm;
+		m_current_preprocessor = &pp;
 
-		std::unordered_set<std::string> direct_inclusions;
 		pp.addPPCallbacks(std::make_unique<InclusionHandler>(this));
 
-		m_source_cache.clear();
+		m_result = UnrolledSource();
+		m_source_indices.clear();
 		m_angled_inclusions.clear();
-		const std::string input_filename =
-			sm.getFilename(sm.getLocForStartOfFile(sm.getMainFileID()));
-		m_source_cache.emplace(input_filename, split_text(m_input_content));
-		m_current_source = &m_source_cache[input_filename];
+		m_pending_skip = nullptr;
+		m_skipped_any = false;
+		m_consistent = true;
+		m_undefined_macros.clear();
+		m_pending_guard.clear();
+		m_current_source =
+			add_source(sm.getFileEntryForID(sm.getMainFileID()));
 
 		pp.EnterMainSourceFile();
-		std::ostringstream oss;
-		int last_line = -1;
+		// Offsets of the line recorded last; the remaining tokens on that
+		// line are passed over without looking up their line number.
+		int last_source = -1;
+		unsigned int line_begin = 0, line_end = 0;
 		for(;;){
-			const auto before_current_source = m_current_source;
 			clang::Token tok;
 			pp.Lex(tok);
-			if(tok.is(clang::tok::eof)){ break; }
-			if(!m_current_source){ continue; }
-			const auto loc = tok.getLocation();
-			const int cur_line = sm.getPresumedLineNumber(loc) - 1;
+			if(tok.is(clang::tok::eof) || !m_consistent){ break; }
+			if(m_current_source < 0){ continue; }
+			auto loc = tok.getLocation();
+			if(loc.isMacroID()){ loc = sm.getExpansionLoc(loc); }
+			const auto raw = loc.getRawEncoding();
+			if(raw < m_current_begin || m_current_end <= raw){ continue; }
+			const auto offset = raw - m_current_begin;
 			if(
-				before_current_source != m_current_source ||
-				cur_line != last_line)
+				last_source == m_current_source &&
+				line_begin <= offset && offset < line_end)
 			{
-				oss << (*m_current_source)[cur_line] << std::endl;
+				continue;
 			}
-			last_line = cur_line;
-		}
-		std::ostringstream oss_stdcxx;
-		for(const auto &s : m_angled_inclusions){
-			oss_stdcxx << "#include <" << s << ">" << std::endl;
+			const auto &starts =
+				m_result.sources[m_current_source].line_starts;
+			const auto it = std::upper_bound(starts.begin(), starts.end(), offset);
+			const unsigned int cur_line = (it - starts.begin()) - 1;
+			line_begin = starts[cur_line];
+			line_end = (it != starts.end())
+				? *it : std::numeric_limits<unsigned int>::max();
+			last_source = m_current_source;
+			m_result.lines.push_back(UnrolledSource::Line{
+				static_cast<unsigned int>(m_current_source), cur_line});
 		}
+		if(!m_consistent || !m_pending_guard.empty()){ return; }
 		if(m_result_ptr){
-			*m_result_ptr = oss_stdcxx.str() + oss.str();
+			*m_result_ptr = std::move(m_result);
 		}
 	}
 
 private:
-	std::vector<std::string> split_text(const std::string &text) const {
-		std::istringstream iss(text);
-		std::string line;
-		std::vector<std::string> result;
-		while(std::getline(iss, line)){
-			result.emplace_back(std::move(line));
-		}
-		return result;
+	int add_source(const clang::FileEntry *file){
+		const auto filename = file->getName().str();
+		// The same buffer the preprocessor reads from
+		llvm::StringRef text;
+		m_session.file_contents(file, text);
+		const int index = m_result.sources.size();
+		m_result.sources.emplace_back(filename, text);
+		m_source_indices.emplace(filename, index);
+		return index;
 	}
 
-	std::vector<std::string> load_text_file(const std::string &filename) const {
-		std::ifstream ifs(filename.c_str());
-		std::string line;
-		std::vector<std::string> result;
-		while(std::getline(ifs, line)){
-			result.emplace_back(std::move(line));
+	void OnFileChanged(
+		clang::SourceLocation loc,
+		clang::PPCallbacks::FileChangeReason reason)
+	{
+		auto &sm = *m_current_source_manager;
+		const auto path = sm.getFilename(loc).str();
+		const auto it = m_source_indices.find(path);
+		if(it != m_source_indices.end()){
+			m_current_source = it->second;
+		}else{
+			m_current_source = -1;
+		}
+		const auto file_id = sm.getFileID(loc);
+		m_current_begin = sm.getLocForStartOfFile(file_id).getRawEncoding();
+		// The end of file position is included
+		m_current_end = m_current_begin + sm.getFileIDSize(file_id) + 1;
+		const auto skip = m_pending_skip;
+		m_pending_skip = nullptr;
+		if(
+			reason == clang::PPCallbacks::EnterFile && skip &&
+			sm.getFileEntryForID(sm.getFileID(loc)) == skip)
+		{
+			// FileChanged(EnterFile) is sent by EnterSourceFileWithLexer()
+			// once the lexer of the new file is the current one. Since PTH
+			// was removed in clang 8, clang::Lexer is the only kind of
+			// PreprocessorLexer, so the cast is exact. Moving the lexer to
+			// the end of its buffer makes the header look empty, and it is
+			// then left through the usual end of file handling.
+			auto lexer = static_cast<clang::Lexer *>(
+				m_current_preprocessor->getCurrentLexer());
+			lexer->cutOffLexing();
+			m_skipped_any = true;
 		}
-		return result;
 	}
 
-	void OnFileChanged(clang::SourceLocation loc){
-		auto &sm = *m_current_source_manager;
-		const auto path = sm.getFilename(loc).str();
-		const auto it = m_source_cache.find(path);
-		if(it != m_source_cache.end()){
-			m_current_source = &it->second;
+	bool InQuotedSource() const {
+		return m_skipped_any && m_current_source >= 0;
+	}
+
+	// Macros defined by skipped headers are missing, so a quoted file may
+	// only test macros whose state does not depend on them: defined ones,
+	// ones it has #undef'd itself and include guards.
+	bool IsReliableMacro(const clang::IdentifierInfo *identifier) const {
+		if(m_current_preprocessor->isMacroDefined(identifier)){ return true; }
+		return m_undefined_macros.count(identifier->getName().str()) > 0;
+	}
+
+	void OnDirective(){
+		if(!InQuotedSource()){ return; }
+		if(!m_pending_guard.empty()){ m_consistent = false; }
+	}
+
+	void OnCondition(clang::SourceRange range){
+		if(!InQuotedSource()){ return; }
+		OnDirective();
+		auto &pp = *m_current_preprocessor;
+		const auto &lang_options = pp.getLangOpts();
+		// Lexed again from a copy since the raw lexer needs a terminator
+		const std::string text = clang::Lexer::getSourceText(
+			clang::CharSourceRange::getTokenRange(range),
+			*m_current_source_manager, lang_options).str();
+		clang::Lexer lexer(
+			clang::SourceLocation(), lang_options,
+			text.data(), text.data(), text.data() + text.size());
+		static const std::unordered_set<std::string> operator_names = {
+			"defined", "true", "false", "and", "or", "not", "bitand",
+			"bitor", "xor", "compl", "and_eq", "or_eq", "xor_eq", "not_eq"
+		};
+		clang::Token tok;
+		lexer.LexFromRawLexer(tok);
+		while(!tok.is(clang::tok::eof)){
+			if(!tok.is(clang::tok::raw_identifier)){
+				lexer.LexFromRawLexer(tok);
+				continue;
+			}
+			const auto name = tok.getRawIdentifier();
+			lexer.LexFromRawLexer(tok);
+			if(operator_names.count(name.str())){ continue; }
+			const auto identifier = pp.getIdentifierInfo(name);
+			if(!IsReliableMacro(identifier)){
+				m_consistent = false;
+				return;
+			}
+			// Arguments of __has_include and friends are not macros
+			const auto info = pp.getMacroInfo(identifier);
+			if(info && info->isBuiltinMacro() && tok.is(clang::tok::l_paren)){
+				int level = 0;
+				do{
+					if(tok.is(clang::tok::l_paren)){ ++level; }
+					if(tok.is(clang::tok::r_paren)){ --level; }
+					lexer.LexFromRawLexer(tok);
+				}while(level > 0 && !tok.is(clang::tok::eof));
+			}
+		}
+	}
+
+	void OnMacroTest(
+		const clang::Token &macro_name,
+		const clang::MacroDefinition &definition,
+		bool is_ifndef)
+	{
+		if(!InQuotedSource()){ return; }
+		OnDirective();
+		const auto identifier = macro_name.getIdentifierInfo();
+		if(definition || IsReliableMacro(identifier)){ return; }
+		if(is_ifndef){
+			// Presumably an include guard; it must be defined right away.
+			m_pending_guard = identifier->getName().str();
 		}else{
-			m_current_source = nullptr;
+			m_consistent = false;
+		}
+	}
+
+	void OnMacroDefined(const clang::Token &macro_name, bool defined){
+		if(m_current_source < 0){ return; }
+		const auto name = macro_name.getIdentifierInfo()->getName().str();
+		if(defined){
+			m_undefined_macros.erase(name);
+		}else{
+			m_undefined_macros.insert(name);
+		}
+		if(!m_skipped_any){ return; }
+		if(defined && name == m_pending_guard){
+			m_pending_guard.clear();
+		}else{
+			OnDirective();
 		}
 	}
 
@@ -157,14 +361,20 @@ private:
 		bool is_angled,
 		const clang::FileEntry *file)
 	{
+		if(!file){ return; }
 		const std::string path(file->getName());
 		auto &sm = *m_current_source_manager;
 		const auto from = sm.getFilename(hash_loc).str();
-		if(m_source_cache.find(from) != m_source_cache.end()){
+		OnDirective();
+		if(m_source_indices.find(from) != m_source_indices.end()){
 			if(is_angled){
-				m_angled_inclusions.insert(filename.str());
-			}else if(m_source_cache.find(path) == m_source_cache.end()){
-				m_source_cache.emplace(path, load_text_file(path));
+				// Hoisted in the order they first appear
+				if(m_angled_inclusions.insert(filename.str()).second){
+					m_result.angled_inclusions.push_back(filename.str());
+				}
+				if(m_skip_angled_headers){ m_pending_skip = file; }
+			}else if(m_source_indices.find(path) == m_source_indices.end()){
+				add_source(file);
 			}
 		}
 	}
@@ -176,45 +386,70 @@ class InclusionUnrollingActionFactory
 {
 
 private:
-	std::shared_ptr<std::string> m_result_ptr;
-	std::string m_input_content;
-	std::string m_input_filename;
+	std::shared_ptr<UnrolledSource> m_result_ptr;
+	CompilationSession &m_session;
+	bool m_skip_angled_headers;
 
 public:
 	InclusionUnrollingActionFactory(
-		std::shared_ptr<std::string> result_ptr,
-		std::string input_content,
-		std::string input_filename)
+		std::shared_ptr<UnrolledSource> result_ptr,
+		CompilationSession &session,
+		bool skip_angled_headers)
 		: m_result_ptr(std::move(result_ptr))
-		, m_input_content(std::move(input_content))
-		, m_input_filename(std::move(input_filename))
+		, m_session(session)
+		, m_skip_angled_headers(skip_angled_headers)
 	{ }
 
 	virtual std::unique_ptr<clang::FrontendAction> create() override {
 		return std::make_unique<InclusionUnrollingAction>(
-			m_result_ptr, m_input_content, m_input_filename);
+			m_result_ptr, m_session, m_skip_angled_headers);
 	}
 
 };
 
 
-std::string unroll_inclusion(
-	const std::string &input_source,
-	const std::string &input_filename,
-	const std::vector<std::string> &clang_options)
+UnrolledSource::Source::Source(std::string filename, llvm::StringRef text)
+	: filename(std::move(filename))
+	, text(text)
+	, line_starts()
 {
-	namespace tooling = clang::tooling;
-	tooling::FixedCompilationDatabase compilations(".", clang_options);
-	tooling::ClangTool tool(
-		compilations, llvm::ArrayRef<std::string>(input_filename));
-	tool.mapVirtualFile(input_filename, input_source);
-
-	auto result_ptr = std::make_shared<std::string>();
-	tool.appendArgumentsAdjuster(tooling::getClangSyntaxOnlyAdjuster());
-	const auto result = tool.run(
-		std::make_unique<InclusionUnrollingActionFactory>(
-			result_ptr, input_source, input_filename).get());
-
-	return *result_ptr;
+	index_lines(text, line_starts);
 }
 
+llvm::StringRef UnrolledSource::Source::line(unsigned int i) const {
+	// Empty text has no lines
+	if(i >= line_starts.size()){ return text.substr(text.size()); }
+	const std::size_t begin = line_starts[i];
+	std::size_t end = text.size();
+	if(i + 1 < line_starts.size()){
+		end = line_starts[i + 1] - 1;
+	}else if(!text.empty() && text.back() == '\n'){
+		--end;
+	}
+	return text.slice(begin, end);
+}
+
+
+UnrolledSource unroll_inclusion(CompilationSession &session){
+	{
+		UnrolledSource result;
+		if(scan_directives(session, result)){ return result; }
+	}
+
+	// Angled headers are skipped first. The action leaves the result
+	// empty when that may have changed the outcome, and the preprocessor
+	// is run again over everything.
+	for(const bool skip_angled_headers : { true, false }){
+		auto result_ptr = std::make_shared<UnrolledSource>();
+		// Preprocessor errors have already been reported by the analysis pass.
+		clang::DiagnosticConsumer diag_consumer;
+		InclusionUnrollingActionFactory factory(
+			result_ptr, session, skip_angled_headers);
+		if(!session.run(factory, {}, &diag_consumer)){
+			if(skip_angled_headers){ continue; }
+			throw std::runtime_error("preprocessing error");
+		}
+		if(!result_ptr->sources.empty()){ return std::move(*result_ptr); }
+	}
+	throw std::runtime_error("preprocessing error");
+}
@@ -3,11 +3,36 @@
 
 #include <string>
 #include <vector>
+#include <llvm/ADT/StringRef.h>
 
-std::string unroll_inclusion(
-	const std::string &input_source,
-	const std::string &input_filename,
-	const std::vector<std::string> &clang_options);
+class CompilationSession;
 
-#endif
+struct UnrolledSource {
+	struct Line {
+		unsigned int file;
+		unsigned int line;
+	};
+	// A quoted file. text refers to the buffer held by the session's file
+	// manager, which is what the passes have read.
+	struct Source {
+		std::string filename;
+		llvm::StringRef text;
+		// Offsets of the beginnings of lines
+		std::vector<unsigned int> line_starts;
+
+		Source(std::string filename, llvm::StringRef text);
+		// Text of a line without its line break
+		llvm::StringRef line(unsigned int i) const;
+	};
+	// Angled inclusions to be hoisted to the head of the output, in the order
+	// they first appear
+	std::vector<std::string> angled_inclusions;
+	// Quoted files, indexed by Line::file
+	std::vector<Source> sources;
+	// Lines of the unrolled source in output order
+	std::vector<Line> lines;
+};
 
+UnrolledSource unroll_inclusion(CompilationSession &session);
+
+#endif
@@ -0,0 +1,89 @@
+#include <cstring>
+#include <cstdint>
+#include "line_index.hpp"
+
+// The AVX2 kernel is compiled whatever the target of this file and picked
+// at run time, so generic x86 builds still use it where it is available
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LINE_INDEX_AVX2
+#endif
+
+#if defined(LINE_INDEX_AVX2) || defined(__SSE2__)
+#include <immintrin.h>
+
+static void push_bits(
+	std::vector<unsigned int> &line_starts, std::uint32_t mask, std::size_t base)
+{
+	while(mask != 0){
+		line_starts.push_back(
+			static_cast<unsigned int>(base + __builtin_ctz(mask) + 1));
+		mask &= mask - 1;
+	}
+}
+#endif
+
+// Each kernel indexes the whole blocks of [i, n) and returns where it stopped
+
+#if defined(LINE_INDEX_AVX2)
+__attribute__((target("avx2")))
+static std::size_t index_avx2(
+	const char *data, std::size_t i, std::size_t n,
+	std::vector<unsigned int> &line_starts)
+{
+	const __m256i newline = _mm256_set1_epi8('\n');
+	for(; i + 32 <= n; i += 32){
+		const __m256i chunk =
+			_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		push_bits(line_starts, static_cast<std::uint32_t>(
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline))), i);
+	}
+	return i;
+}
+
+static bool cpu_supports_avx2(){
+#if defined(__AVX2__)
+	return true;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#if defined(__SSE2__)
+static std::size_t index_sse2(
+	const char *data, std::size_t i, std::size_t n,
+	std::vector<unsigned int> &line_starts)
+{
+	const __m128i newline = _mm_set1_epi8('\n');
+	for(; i + 16 <= n; i += 16){
+		const __m128i chunk =
+			_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		push_bits(line_starts, static_cast<std::uint32_t>(
+			_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline))), i);
+	}
+	return i;
+}
+#endif
+
+void index_lines(llvm::StringRef text, std::vector<unsigned int> &line_starts){
+	if(text.empty()){ return; }
+	const char *data = text.data();
+	// The last character never starts a line
+	const std::size_t n = text.size() - 1;
+	line_starts.push_back(0);
+	std::size_t i = 0;
+#if defined(LINE_INDEX_AVX2)
+	static const bool avx2 = cpu_supports_avx2();
+	if(avx2){ i = index_avx2(data, i, n, line_starts); }
+#endif
+#if defined(__SSE2__)
+	i = index_sse2(data, i, n, line_starts);
+#endif
+	while(i < n){
+		const void *p = std::memchr(data + i, '\n', n - i);
+		if(!p){ break; }
+		i = static_cast<const char *>(p) - data + 1;
+		line_starts.push_back(static_cast<unsigned int>(i));
+	}
+}
@@ -0,0 +1,12 @@
+#ifndef CPP_SIMPLIFIER_LINE_INDEX_HPP
+#define CPP_SIMPLIFIER_LINE_INDEX_HPP
+
+#include <vector>
+#include <llvm/ADT/StringRef.h>
+
+// Appends the offset of the first character of every line in text to
+// line_starts. Empty text has no lines and a trailing line break does not
+// start a new one, so line i spans [line_starts[i], line_starts[i + 1] - 1).
+void index_lines(llvm::StringRef text, std::vector<unsigned int> &line_starts);
+
+#endif
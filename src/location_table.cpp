@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <clang/Basic/CharInfo.h>
+#include <clang/Lex/Lexer.h>
+#include "location_table.hpp"
+
+LocationTable::LocationTable()
+	: m_entries()
+	, m_files()
+	, m_end(0)
+{ }
+
+void LocationTable::build(const clang::SourceManager &sm){
+	clear();
+	const unsigned int count = sm.local_sloc_entry_size();
+	m_entries.reserve(count);
+	m_end = sm.getNextLocalOffset();
+	for(unsigned int i = 0; i < count; ++i){
+		const auto &sloc = sm.getLocalSLocEntry(i);
+		Entry entry{ sloc.getOffset(), 0, 0, sloc.isFile(), UNRESOLVED };
+		if(sloc.isFile()){
+			const auto start =
+				clang::SourceLocation::getFromRawEncoding(sloc.getOffset());
+			const auto id = sm.getFileID(start);
+			bool invalid = false;
+			const auto text = sm.getBufferData(id, &invalid);
+			const bool system = sm.isInSystemHeader(start);
+			entry.file = m_files.size();
+			if(sloc.getFile().hasLineDirectives()){
+				entry.kind = LINE_DIRECTIVES;
+			}else{
+				entry.kind = system ? SYSTEM : USER;
+			}
+			m_files.push_back(File{
+				id, start, invalid ? llvm::StringRef() : text,
+				sm.getFileEntryForID(id), system });
+		}
+		m_entries.push_back(entry);
+	}
+	// The expansion location of a macro location depends only on its
+	// entry, so it is resolved once here
+	for(auto &entry : m_entries){
+		if(entry.is_file){ continue; }
+		const auto &sloc = sm.getLocalSLocEntry(&entry - m_entries.data());
+		const auto loc =
+			sm.getExpansionLoc(sloc.getExpansion().getExpansionLocStart());
+		if(loc.isInvalid() || loc.getRawEncoding() >= m_end){ continue; }
+		const auto decomposed = sm.getDecomposedLoc(loc);
+		entry.file = m_entries[decomposed.first.getHashValue()].file;
+		entry.expansion = decomposed.second;
+		entry.kind = sm.isInSystemHeader(loc) ? SYSTEM : USER;
+	}
+}
+
+void LocationTable::clear(){
+	m_entries.clear();
+	m_files.clear();
+	m_end = 0;
+}
+
+const LocationTable::Entry *LocationTable::find(
+	const clang::SourceLocation &loc) const
+{
+	if(m_entries.empty() || loc.isInvalid()){ return nullptr; }
+	// SourceLocation::getOffset() is private; the raw encoding is the
+	// offset with the top bit set for macro locations
+	const auto offset = loc.getRawEncoding() & ~(1u << 31);
+	if(offset >= m_end){ return nullptr; }
+	auto it = std::upper_bound(
+		m_entries.begin(), m_entries.end(), offset,
+		[](unsigned int value, const Entry &entry){
+			return value < entry.offset;
+		});
+	if(it == m_entries.begin()){ return nullptr; }
+	--it;
+	if(it->kind == UNRESOLVED){ return nullptr; }
+	return &*it;
+}
+
+unsigned int LocationTable::expansion_offset(
+	const Entry &entry, const clang::SourceLocation &loc) const
+{
+	if(!entry.is_file){ return entry.expansion; }
+	return loc.getRawEncoding() - entry.offset;
+}
+
+bool LocationTable::is_in_system_header(
+	const clang::SourceLocation &loc, bool &result) const
+{
+	const auto entry = find(loc);
+	if(!entry || entry->kind == LINE_DIRECTIVES){ return false; }
+	result = (entry->kind == SYSTEM);
+	return true;
+}
+
+bool LocationTable::decompose(
+	const clang::SourceLocation &loc,
+	clang::FileID &file_id,
+	unsigned int &offset) const
+{
+	const auto entry = find(loc);
+	if(!entry){ return false; }
+	file_id = m_files[entry->file].id;
+	offset = expansion_offset(*entry, loc);
+	return true;
+}
+
+bool LocationTable::end_of_token(
+	const clang::SourceLocation &loc,
+	const clang::LangOptions &lang_options,
+	clang::SourceLocation &result) const
+{
+	const auto entry = find(loc);
+	if(!entry){ return false; }
+	const auto &file = m_files[entry->file];
+	const auto offset = expansion_offset(*entry, loc);
+	result = file.start.getLocWithOffset(offset);
+	// As Lexer::MeasureTokenLength(), which fails at whitespace
+	if(offset >= file.text.size() || clang::isWhitespace(file.text[offset])){
+		return true;
+	}
+	clang::Lexer lexer(
+		file.start, lang_options,
+		file.text.begin(), file.text.begin() + offset, file.text.end());
+	lexer.SetCommentRetentionState(true);
+	clang::Token token;
+	lexer.LexFromRawLexer(token);
+	result = result.getLocWithOffset(token.getLength());
+	return true;
+}
+
+const LocationTable::File *LocationTable::file(
+	const clang::FileID &file_id) const
+{
+	const auto index = static_cast<unsigned int>(file_id.getHashValue());
+	if(index >= m_entries.size() || !m_entries[index].is_file){
+		return nullptr;
+	}
+	return &m_files[m_entries[index].file];
+}
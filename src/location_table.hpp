@@ -0,0 +1,82 @@
+#ifndef CPP_SIMPLIFIER_LOCATION_TABLE_HPP
+#define CPP_SIMPLIFIER_LOCATION_TABLE_HPP
+
+#include <vector>
+#include <llvm/ADT/StringRef.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/LangOptions.h>
+#include <clang/Basic/SourceLocation.h>
+#include <clang/Basic/SourceManager.h>
+
+// Snapshot of the local source location entries of a SourceManager.
+// Queries to a SourceManager update its lookup caches, so they cannot be
+// made from several threads at once; the table answers the ones the
+// analyzer needs from data that is only read after build().
+// Locations the table cannot answer for, such as those in entries loaded
+// from a PCH, make the queries return false, and the caller must then ask
+// the SourceManager itself.
+class LocationTable {
+
+public:
+	struct File {
+		clang::FileID id;
+		clang::SourceLocation start;
+		llvm::StringRef text;
+		const clang::FileEntry *entry;
+		// Whether the start of the file is in a system header
+		bool system;
+	};
+
+private:
+	enum Kind : unsigned char {
+		USER,
+		SYSTEM,
+		// #line directives may change the kind partway through the file
+		LINE_DIRECTIVES,
+		// Expands to a location outside of the table
+		UNRESOLVED
+	};
+
+	struct Entry {
+		unsigned int offset;
+		// Index in m_files of the file the entry expands to
+		unsigned int file;
+		// Offset in that file of the expansion location, for macros
+		unsigned int expansion;
+		bool is_file;
+		Kind kind;
+	};
+
+	// Indexed like the local entries of the SourceManager, so by the hash
+	// values of local FileIDs
+	std::vector<Entry> m_entries;
+	std::vector<File> m_files;
+	unsigned int m_end;
+
+	const Entry *find(const clang::SourceLocation &loc) const;
+	unsigned int expansion_offset(
+		const Entry &entry, const clang::SourceLocation &loc) const;
+
+public:
+	LocationTable();
+
+	void build(const clang::SourceManager &sm);
+	void clear();
+
+	// Same as SourceManager::isInSystemHeader() on the expansion location
+	bool is_in_system_header(const clang::SourceLocation &loc, bool &result) const;
+	// Same as SourceManager::getDecomposedLoc() on the expansion location
+	bool decompose(
+		const clang::SourceLocation &loc,
+		clang::FileID &file_id,
+		unsigned int &offset) const;
+	// Same as Lexer::getLocForEndOfToken() on the expansion location
+	bool end_of_token(
+		const clang::SourceLocation &loc,
+		const clang::LangOptions &lang_options,
+		clang::SourceLocation &result) const;
+	// nullptr if file_id is not a local file
+	const File *file(const clang::FileID &file_id) const;
+};
+
+#endif
@@ -1,23 +1,205 @@
-#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <fstream>
-#include <sstream>
+#include <future>
+#include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include <boost/program_options.hpp>
-#include "syntax_checker.hpp"
+#include <llvm/Support/MemoryBuffer.h>
 #include "inclusion_unroller.hpp"
 #include "simplifier.hpp"
+#include "pch_cache.hpp"
+#include "output_writer.hpp"
+#include "reachability_index.hpp"
+#include "compilation_session.hpp"
+
+// Exit statuses when the budget runs out
+static const int EXIT_UNPRUNED = 2;
+static const int EXIT_NO_OUTPUT = 3;
+
+// Limits on the time and memory spent; the passes themselves cannot be
+// interrupted, so the limits are checked while waiting for them.
+class Budget {
+
+private:
+	using clock = std::chrono::steady_clock;
+	clock::time_point m_deadline;
+	std::size_t m_memory_limit;
+
+	static std::size_t resident_memory(){
+		std::ifstream ifs("/proc/self/statm");
+		std::size_t total = 0, resident = 0;
+		if(!(ifs >> total >> resident)){ return 0; }
+		return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+	}
+
+public:
+	Budget()
+		: m_deadline(clock::time_point::max())
+		, m_memory_limit(0)
+	{ }
+
+	void set_deadline(unsigned int milliseconds){
+		m_deadline = clock::now() + std::chrono::milliseconds(milliseconds);
+	}
+	void set_memory_limit(std::size_t megabytes){
+		m_memory_limit = megabytes << 20;
+	}
+
+	bool limited() const {
+		return m_deadline != clock::time_point::max() || m_memory_limit != 0;
+	}
+	bool exhausted() const {
+		if(clock::now() >= m_deadline){ return true; }
+		return m_memory_limit != 0 && resident_memory() > m_memory_limit;
+	}
+
+	// Waits until future is ready; returns false if the budget runs out
+	// first.
+	template <typename T>
+	bool wait(std::future<T> &future) const {
+		if(!limited()){
+			future.wait();
+			return true;
+		}
+		const auto interval = std::chrono::milliseconds(10);
+		while(future.wait_for(interval) != std::future_status::ready){
+			if(exhausted()){ return false; }
+		}
+		return true;
+	}
+
+};
 
-std::string read_from_stream(std::istream &is){
-	std::ostringstream oss;
-	std::string line;
-	while(std::getline(is, line)){ oss << line << std::endl; }
-	return oss.str();
+static bool write_output(
+	const boost::program_options::variables_map &vm,
+	const SimplifiedSource &result)
+{
+	int fd = STDOUT_FILENO;
+	if(vm.count("output")){
+		const auto output_filename = vm["output"].as<std::string>();
+		fd = ::open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if(fd < 0){
+			std::cerr << output_filename << ": cannot open" << std::endl;
+			return false;
+		}
+	}
+	std::vector<llvm::StringRef> pieces(1, result.head);
+	pieces.insert(pieces.end(), result.body.begin(), result.body.end());
+	const bool written = write_pieces(fd, pieces);
+	if(fd != STDOUT_FILENO){ ::close(fd); }
+	return written;
+}
+
+// Exits without waiting for passes still running on other threads
+[[noreturn]] static void abandon(int status){
+	std::cout.flush();
+	std::cerr.flush();
+	std::_Exit(status);
+}
+
+static std::vector<std::string> clang_options_from(
+	const boost::program_options::variables_map &vm)
+{
+	std::vector<std::string> clang_options;
+	if(vm.count("std")){
+		clang_options.push_back("-std=" + vm["std"].as<std::string>());
+	}
+	if(vm.count("include-path")){
+		for(const auto &s : vm["include-path"].as<std::vector<std::string>>()){
+			clang_options.push_back("-I" + s);
+		}
+	}
+	if(vm.count("define")){
+		for(const auto &s : vm["define"].as<std::vector<std::string>>()){
+			clang_options.push_back("-D" + s);
+		}
+	}
+	return clang_options;
+}
+
+// cpp-simplifier index <library-directory> -o <index-file>
+static int run_index(int argc, const char *argv[]){
+	namespace po = boost::program_options;
+
+	po::options_description general_options("cpp-simplifier index");
+	general_options.add_options()
+		("help,h", "Display available options")
+		("output,o",
+			po::value<std::string>(),
+			"Destination to write the index")
+		("std",
+			po::value<std::string>()->default_value("c++11"),
+			"Language standard to process for")
+		("include-path,I",
+			po::value<std::vector<std::string>>()->composing(),
+			"Add directory to include search path")
+		("define,D",
+			po::value<std::vector<std::string>>()->composing(),
+			"Add macro definition before parsing")
+		("invocation-cache",
+			po::value<std::string>(),
+			"Directory to cache resolved compiler invocations in");
+	po::options_description hidden_options("hidden options");
+	hidden_options.add_options()
+		("library-directory", po::value<std::string>(), "Library directory");
+	po::options_description all_options;
+	all_options.add(general_options).add(hidden_options);
+
+	po::positional_options_description positional_desc;
+	positional_desc.add("library-directory", -1);
+
+	po::variables_map vm;
+	po::store(
+		po::command_line_parser(argc, argv)
+			.options(all_options)
+			.positional(positional_desc)
+			.run(),
+		vm);
+	po::notify(vm);
+
+	if(
+		vm.count("help") ||
+		vm.count("library-directory") == 0 ||
+		vm.count("output") == 0)
+	{
+		std::cout << general_options << std::endl;
+		return 1;
+	}
+
+	// Each header is parsed as its own input; the session input is unused
+	CompilationSession session(
+		"(index).cpp",
+		llvm::MemoryBuffer::getMemBuffer("", "(index).cpp"),
+		clang_options_from(vm));
+	if(vm.count("invocation-cache")){
+		session.set_invocation_cache(vm["invocation-cache"].as<std::string>());
+	}
+
+	const auto index = build_reachability_index(
+		session, vm["library-directory"].as<std::string>());
+	if(!index){ return -1; }
+	const auto output_filename = vm["output"].as<std::string>();
+	if(!index->save(output_filename)){
+		std::cerr << output_filename << ": cannot write" << std::endl;
+		return -1;
+	}
+	return 0;
 }
 
 int main(int argc, const char *argv[]){
 	namespace po = boost::program_options;
 
+	if(argc >= 2 && std::string(argv[1]) == "index"){
+		return run_index(argc - 1, argv + 1);
+	}
+
 	po::options_description general_options("cpp-simplifier");
 	general_options.add_options()
 		("help,h", "Display available options")
@@ -32,7 +214,35 @@ int main(int argc, const char *argv[]){
 			"Add directory to include search path")
 		("define,D",
 			po::value<std::vector<std::string>>()->composing(),
-			"Add macro definition before parsing");
+			"Add macro definition before parsing")
+		("pch-cache",
+			po::value<std::string>(),
+			"Directory to cache precompiled angled inclusions in")
+		("invocation-cache",
+			po::value<std::string>(),
+			"Directory to cache resolved compiler invocations in")
+		("skip-system-bodies",
+			"Do not parse non-template function bodies in system headers")
+		("index",
+			po::value<std::string>(),
+			"Reachability index made by `cpp-simplifier index`")
+		("jobs,j",
+			po::value<unsigned int>()->default_value(1),
+			"Number of threads for reachability analysis (0: all cores)")
+		("deadline",
+			po::value<unsigned int>(),
+			"Time budget in milliseconds; when it runs out, the unrolled but "
+			"unpruned source is written and the exit status is 2, or nothing "
+			"is written and the exit status is 3")
+		("memory-limit",
+			po::value<std::size_t>(),
+			"Memory budget in MiB, handled like --deadline")
+		("prune-includes",
+			"Keep only the angled inclusions that the remaining code depends on")
+		("collapse-includes",
+			po::value<unsigned int>(),
+			"Replace standard headers with <bits/stdc++.h> when more than this "
+			"many of them are included");
 	po::options_description hidden_options("hidden options");
 	hidden_options.add_options()
 		("input-file", po::value<std::string>(), "Input file");
@@ -56,47 +266,128 @@ int main(int argc, const char *argv[]){
 		return 1;
 	}
 
-	std::vector<std::string> clang_options;
-	if(vm.count("std")){
-		clang_options.push_back("-std=" + vm["std"].as<std::string>());
+	Budget budget;
+	if(vm.count("deadline")){
+		budget.set_deadline(vm["deadline"].as<unsigned int>());
 	}
-	if(vm.count("include-path")){
-		for(const auto &s : vm["include-path"].as<std::vector<std::string>>()){
-			clang_options.push_back("-I" + s);
-		}
-	}
-	if(vm.count("define")){
-		for(const auto &s : vm["define"].as<std::vector<std::string>>()){
-			clang_options.push_back("-D" + s);
-		}
+	if(vm.count("memory-limit")){
+		budget.set_memory_limit(vm["memory-limit"].as<std::size_t>());
 	}
 
+	auto clang_options = clang_options_from(vm);
+
+	// The input is read into a single buffer (mapped if possible) that
+	// every pass and the output refer to.
 	auto input_filename = vm["input-file"].as<std::string>();
-	std::string input_source;
-	if(input_filename == "-"){
-		input_filename = "(stdin).cpp";
-		input_source = read_from_stream(std::cin);
-	}else{
-		std::ifstream ifs(input_filename.c_str());
-		input_source = read_from_stream(ifs);
+	auto input_buffer = llvm::MemoryBuffer::getFileOrSTDIN(input_filename);
+	if(!input_buffer){
+		std::cerr << input_filename << ": "
+		          << input_buffer.getError().message() << std::endl;
+		return -1;
 	}
+	if(input_filename == "-"){ input_filename = "(stdin).cpp"; }
 
-	const auto validity =
-		check_syntax(input_source, input_filename, clang_options);
-	if(!validity){ return -1; }
+	// All passes share one file manager, so headers are looked up and
+	// read only once.
+	CompilationSession session(
+		input_filename, std::move(*input_buffer), std::move(clang_options));
+	if(vm.count("invocation-cache")){
+		session.set_invocation_cache(vm["invocation-cache"].as<std::string>());
+	}
 
-	const auto unrolled = unroll_inclusion(
-		input_source, input_filename, clang_options);
+	// Unrolling does not depend on the analysis, so it runs on its own
+	// thread with a session of its own.
+	const auto unroll_session = session.fork();
+	auto unrolled_future = std::async(std::launch::async, [&unroll_session](){
+		return unroll_inclusion(*unroll_session);
+	});
 
-	const auto result = simplify(unrolled, input_filename, clang_options);
+	// The analysis parse doubles as the syntax check; it is the only pass
+	// that reports diagnostics. It runs on another thread as well so that
+	// the budget can be watched from this one.
+	ReachabilityAnalyzerOptions analyzer_options;
+	analyzer_options.skip_system_function_bodies =
+		vm.count("skip-system-bodies") > 0;
+	analyzer_options.jobs = vm["jobs"].as<unsigned int>();
+	if(analyzer_options.jobs == 0){
+		analyzer_options.jobs = std::max(1u, std::thread::hardware_concurrency());
+	}
+	if(vm.count("prune-includes")){
+		analyzer_options.required_headers = std::make_shared<RequiredHeaders>();
+	}
+	if(vm.count("index")){
+		const auto index_filename = vm["index"].as<std::string>();
+		auto index = std::make_shared<ReachabilityIndex>();
+		if(index->load(index_filename)){
+			analyzer_options.index = std::move(index);
+		}else{
+			std::cerr << index_filename << ": not a valid index; ignored"
+			          << std::endl;
+		}
+	}
+	auto markers_future = std::async(std::launch::async, [&](){
+		// The unroller only preprocesses, so precompiled headers are used
+		// by the analysis pass alone.
+		std::vector<std::string> analysis_options;
+		if(vm.count("pch-cache")){
+			analysis_options = use_precompiled_header(
+				session, vm["pch-cache"].as<std::string>());
+		}
+		return analyze_reachability(
+			session, analysis_options, analyzer_options);
+	});
 
-	if(vm.count("output")){
-		const auto output_filename = vm["output"].as<std::string>();
-		std::ofstream ofs(output_filename.c_str());
-		ofs << result;
-	}else{
-		std::cout << result;
+	if(!budget.wait(markers_future)){
+		if(
+			unrolled_future.wait_for(std::chrono::seconds(0)) !=
+				std::future_status::ready)
+		{
+			std::cerr << "Budget exhausted before unrolling; "
+			          << "no output written." << std::endl;
+			abandon(EXIT_NO_OUTPUT);
+		}
+		UnrolledSource unrolled;
+		try{
+			unrolled = unrolled_future.get();
+		}catch(const std::exception &){
+			std::cerr << "Budget exhausted and unrolling failed; "
+			          << "no output written." << std::endl;
+			abandon(EXIT_NO_OUTPUT);
+		}
+		std::cerr << "Budget exhausted during analysis; "
+		          << "writing unpruned output." << std::endl;
+		abandon(write_output(vm, unpruned(unrolled)) ? EXIT_UNPRUNED : -1);
 	}
+	const auto markers = markers_future.get();
+	if(!markers){
+		if(budget.limited()){ abandon(-1); }
+		return -1;
+	}
+
+	if(!budget.wait(unrolled_future)){
+		std::cerr << "Budget exhausted before unrolling; "
+		          << "no output written." << std::endl;
+		abandon(EXIT_NO_OUTPUT);
+	}
+	UnrolledSource unrolled;
+	try{
+		unrolled = unrolled_future.get();
+	}catch(const std::exception &){
+		// The analysis has accepted the input, so this is not the user's error
+		std::cerr << session.input_filename()
+		          << ": cannot unroll inclusions of valid input" << std::endl;
+		return -1;
+	}
+
+	InclusionOptions inclusion_options;
+	inclusion_options.required = analyzer_options.required_headers;
+	if(vm.count("collapse-includes")){
+		inclusion_options.collapse_threshold =
+			vm["collapse-includes"].as<unsigned int>();
+	}
+	const auto result = simplify(unrolled, *markers, inclusion_options);
+
+	if(!write_output(vm, result)){ return -1; }
 	return 0;
 }
 
@@ -0,0 +1,38 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#include "output_writer.hpp"
+
+bool write_pieces(int fd, const std::vector<llvm::StringRef> &pieces){
+	std::vector<struct iovec> iov;
+	iov.reserve(pieces.size());
+	for(const auto &p : pieces){
+		if(p.empty()){ continue; }
+		struct iovec v;
+		v.iov_base = const_cast<char *>(p.data());
+		v.iov_len = p.size();
+		iov.push_back(v);
+	}
+	std::size_t first = 0;
+	while(first < iov.size()){
+		const int count = static_cast<int>(
+			std::min<std::size_t>(iov.size() - first, IOV_MAX));
+		const auto written = ::writev(fd, &iov[first], count);
+		if(written < 0){
+			if(errno == EINTR){ continue; }
+			return false;
+		}
+		// Resume after a partial write
+		auto rest = static_cast<std::size_t>(written);
+		while(first < iov.size() && rest >= iov[first].iov_len){
+			rest -= iov[first].iov_len;
+			++first;
+		}
+		if(rest > 0){
+			iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + rest;
+			iov[first].iov_len -= rest;
+		}
+	}
+	return true;
+}
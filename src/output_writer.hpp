@@ -0,0 +1,11 @@
+#ifndef CPP_SIMPLIFIER_OUTPUT_WRITER_HPP
+#define CPP_SIMPLIFIER_OUTPUT_WRITER_HPP
+
+#include <vector>
+#include <llvm/ADT/StringRef.h>
+
+// Writes pieces to fd in order, gathering them into as few system calls
+// as possible. Returns false on a write error.
+bool write_pieces(int fd, const std::vector<llvm::StringRef> &pieces);
+
+#endif
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Basic/Version.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Tooling/Tooling.h>
+#include "pch_cache.hpp"
+#include "compilation_session.hpp"
+
+struct PrecompiledHeaderDependency {
+	std::string path;
+	long long modification_time;
+	long long size;
+};
+
+class PrecompiledHeaderAction : public clang::GeneratePCHAction {
+
+private:
+	std::string m_output_filename;
+	std::shared_ptr<std::vector<PrecompiledHeaderDependency>> m_dependencies;
+
+public:
+	PrecompiledHeaderAction(
+		std::string output_filename,
+		std::shared_ptr<std::vector<PrecompiledHeaderDependency>> dependencies)
+		: clang::GeneratePCHAction()
+		, m_output_filename(std::move(output_filename))
+		, m_dependencies(std::move(dependencies))
+	{ }
+
+protected:
+	virtual bool BeginInvocation(clang::CompilerInstance &ci) override {
+		ci.getFrontendOpts().OutputFile = m_output_filename;
+		return clang::GeneratePCHAction::BeginInvocation(ci);
+	}
+
+	virtual void EndSourceFileAction() override {
+		const auto &sm = getCompilerInstance().getSourceManager();
+		m_dependencies->clear();
+		for(auto it = sm.fileinfo_begin(); it != sm.fileinfo_end(); ++it){
+			const auto file = it->first;
+			m_dependencies->push_back(PrecompiledHeaderDependency{
+				file->getName().str(),
+				static_cast<long long>(file->getModificationTime()),
+				static_cast<long long>(file->getSize())});
+		}
+		clang::GeneratePCHAction::EndSourceFileAction();
+	}
+
+};
+
+class PrecompiledHeaderActionFactory
+	: public clang::tooling::FrontendActionFactory
+{
+
+private:
+	std::string m_output_filename;
+	std::shared_ptr<std::vector<PrecompiledHeaderDependency>> m_dependencies;
+
+public:
+	PrecompiledHeaderActionFactory(
+		std::string output_filename,
+		std::shared_ptr<std::vector<PrecompiledHeaderDependency>> dependencies)
+		: m_output_filename(std::move(output_filename))
+		, m_dependencies(std::move(dependencies))
+	{ }
+
+	virtual std::unique_ptr<clang::FrontendAction> create() override {
+		return std::make_unique<PrecompiledHeaderAction>(
+			m_output_filename, m_dependencies);
+	}
+
+};
+
+
+// Angled inclusions preceding any other code. Only this prefix can be
+// replaced by a precompiled header without changing the meaning of the
+// translation unit.
+static std::vector<std::string> leading_angled_inclusions(
+	llvm::StringRef source)
+{
+	std::vector<std::string> result;
+	while(!source.empty()){
+		const auto split = source.split('\n');
+		const auto line = split.first;
+		source = split.second;
+		std::size_t i = 0;
+		while(i < line.size() && isspace(line[i])){ ++i; }
+		if(i == line.size() || line.substr(i, 2) == "//"){ continue; }
+		if(line[i] != '#'){ break; }
+		++i;
+		while(i < line.size() && isspace(line[i])){ ++i; }
+		if(line.substr(i, 7) != "include"){ break; }
+		i += 7;
+		while(i < line.size() && isspace(line[i])){ ++i; }
+		if(i == line.size() || line[i] != '<'){ break; }
+		const auto close = line.find('>', i);
+		if(close == llvm::StringRef::npos){ break; }
+		auto j = close + 1;
+		while(j < line.size() && isspace(line[j])){ ++j; }
+		if(j < line.size() && line.substr(j, 2) != "//"){ break; }
+		result.push_back(line.slice(i + 1, close).str());
+	}
+	std::sort(result.begin(), result.end());
+	result.erase(std::unique(result.begin(), result.end()), result.end());
+	return result;
+}
+
+static std::string compute_cache_key(
+	const std::vector<std::string> &inclusions,
+	const std::vector<std::string> &clang_options)
+{
+	llvm::MD5 hash;
+	const auto update = [&hash](llvm::StringRef s){
+		hash.update(s);
+		hash.update(llvm::StringRef("\n"));
+	};
+	update(clang::getClangFullVersion());
+	llvm::SmallString<256> working_directory;
+	if(!llvm::sys::fs::current_path(working_directory)){
+		update(working_directory);
+	}
+	for(const auto &s : clang_options){ update(s); }
+	update("");
+	for(const auto &s : inclusions){ update(s); }
+	llvm::MD5::MD5Result result;
+	hash.final(result);
+	return result.digest().str().str();
+}
+
+static bool is_up_to_date(
+	const std::string &pch_path,
+	const std::string &dependency_path)
+{
+	if(!llvm::sys::fs::exists(pch_path)){ return false; }
+	std::ifstream ifs(dependency_path.c_str());
+	if(!ifs){ return false; }
+	std::string line;
+	while(std::getline(ifs, line)){
+		std::istringstream iss(line);
+		long long modification_time = 0, size = 0;
+		std::string path;
+		if(!(iss >> modification_time >> size)){ return false; }
+		std::getline(iss >> std::ws, path);
+		llvm::sys::fs::file_status status;
+		if(llvm::sys::fs::status(path, status)){ return false; }
+		const auto actual_time =
+			llvm::sys::toTimeT(status.getLastModificationTime());
+		if(static_cast<long long>(actual_time) != modification_time){
+			return false;
+		}
+		if(static_cast<long long>(status.getSize()) != size){ return false; }
+	}
+	return true;
+}
+
+static bool build_precompiled_header(
+	CompilationSession &session,
+	const std::string &header_path,
+	const std::string &pch_path,
+	const std::string &dependency_path,
+	const std::vector<std::string> &inclusions)
+{
+	{
+		std::ofstream ofs(header_path.c_str());
+		for(const auto &s : inclusions){
+			ofs << "#include <" << s << ">" << std::endl;
+		}
+		if(!ofs){ return false; }
+	}
+
+	// Errors in the standard headers are reported again by the real parse.
+	clang::DiagnosticConsumer diag_consumer;
+	auto dependencies =
+		std::make_shared<std::vector<PrecompiledHeaderDependency>>();
+	PrecompiledHeaderActionFactory factory(pch_path, dependencies);
+	if(!session.run(header_path, factory, {}, &diag_consumer)){
+		return false;
+	}
+
+	// Written to a unique file first; other processes may check it concurrently
+	int fd = -1;
+	llvm::SmallString<256> temporary_path;
+	if(llvm::sys::fs::createUniqueFile(dependency_path + "-%%%%%%", fd, temporary_path)){
+		return false;
+	}
+	bool succeeded = false;
+	{
+		llvm::raw_fd_ostream os(fd, true);
+		for(const auto &dep : *dependencies){
+			os << dep.modification_time << " " << dep.size << " "
+			   << dep.path << "\n";
+		}
+		os.close();
+		succeeded = !os.has_error();
+		os.clear_error();
+	}
+	if(!succeeded || llvm::sys::fs::rename(temporary_path, dependency_path)){
+		llvm::sys::fs::remove(temporary_path);
+		return false;
+	}
+	return true;
+}
+
+
+std::vector<std::string> use_precompiled_header(
+	CompilationSession &session,
+	const std::string &cache_directory)
+{
+	const auto inclusions = leading_angled_inclusions(session.input_source());
+	if(inclusions.empty()){ return {}; }
+	if(llvm::sys::fs::create_directories(cache_directory)){ return {}; }
+
+	llvm::SmallString<256> base_path(cache_directory);
+	llvm::sys::fs::make_absolute(base_path);
+	llvm::sys::path::append(
+		base_path, compute_cache_key(inclusions, session.clang_options()));
+	const auto header_path = base_path.str().str() + ".hpp";
+	const auto pch_path = base_path.str().str() + ".pch";
+	const auto dependency_path = base_path.str().str() + ".deps";
+
+	if(!is_up_to_date(pch_path, dependency_path)){
+		const auto built = build_precompiled_header(
+			session, header_path, pch_path, dependency_path, inclusions);
+		if(!built){ return {}; }
+	}
+
+	return { "-include-pch", pch_path };
+}
@@ -0,0 +1,18 @@
+#ifndef CPP_SIMPLIFIER_PCH_CACHE_HPP
+#define CPP_SIMPLIFIER_PCH_CACHE_HPP
+
+#include <string>
+#include <vector>
+
+class CompilationSession;
+
+// Returns the options (-include-pch) for a precompiled header that covers
+// the angled inclusions at the head of the session's input. The header is
+// built under cache_directory on first use and rebuilt when any file it
+// depends on has changed. An empty list is returned when there is nothing
+// to precompile or the header cannot be built.
+std::vector<std::string> use_precompiled_header(
+	CompilationSession &session,
+	const std::string &cache_directory);
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef CPP_SIMPLIFIER_POINTER_SET_HPP
+#define CPP_SIMPLIFIER_POINTER_SET_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Set of non-null pointers in a flat open-addressing table with linear
+// probing. clear() keeps the table, so a set reused across traversals
+// stops allocating once it has grown to the working size.
+template <typename T>
+class PointerSet {
+
+private:
+	std::vector<const T *> m_slots;
+	std::size_t m_size;
+
+	std::size_t find_slot(const T *p) const {
+		const std::size_t mask = m_slots.size() - 1;
+		std::size_t i = hash(p) & mask;
+		while(m_slots[i] && m_slots[i] != p){ i = (i + 1) & mask; }
+		return i;
+	}
+
+	void grow(){
+		std::vector<const T *> old(m_slots.size() * 2, nullptr);
+		old.swap(m_slots);
+		for(const auto p : old){
+			if(p){ m_slots[find_slot(p)] = p; }
+		}
+	}
+
+public:
+	static std::size_t hash(const T *p){
+		// Low bits are zero due to alignment
+		const auto x = reinterpret_cast<std::uintptr_t>(p) >> 4;
+		return static_cast<std::size_t>(x * UINT64_C(0x9e3779b97f4a7c15) >> 16);
+	}
+
+	PointerSet()
+		: m_slots(64, nullptr)
+		, m_size(0)
+	{ }
+
+	std::size_t size() const { return m_size; }
+
+	// Returns false if p is already in the set
+	bool insert(const T *p){
+		// Load factor is kept at or below 1/2
+		if((m_size + 1) * 2 > m_slots.size()){ grow(); }
+		const auto i = find_slot(p);
+		if(m_slots[i]){ return false; }
+		m_slots[i] = p;
+		++m_size;
+		return true;
+	}
+
+	bool contains(const T *p) const {
+		return m_slots[find_slot(p)] != nullptr;
+	}
+
+	template <typename F>
+	void for_each(F f) const {
+		for(const auto p : m_slots){
+			if(p){ f(p); }
+		}
+	}
+
+	void clear(){
+		if(m_size == 0){ return; }
+		std::fill(m_slots.begin(), m_slots.end(), nullptr);
+		m_size = 0;
+	}
+
+};
+
+// PointerSet split into independently locked shards, so that several
+// threads can insert at once. Until set_concurrency() is given more than
+// one thread it is a single shard and takes no locks.
+template <typename T>
+class ConcurrentPointerSet {
+
+private:
+	struct Shard {
+		std::mutex mutex;
+		PointerSet<T> set;
+	};
+
+	std::vector<std::unique_ptr<Shard>> m_shards;
+	bool m_locked;
+
+	Shard &shard_of(const T *p){
+		// PointerSet indexes by the low bits of the hash
+		return *m_shards[(PointerSet<T>::hash(p) >> 24) & (m_shards.size() - 1)];
+	}
+
+public:
+	ConcurrentPointerSet()
+		: m_shards()
+		, m_locked(false)
+	{
+		m_shards.emplace_back(new Shard());
+	}
+
+	void set_concurrency(unsigned int threads){
+		m_locked = threads > 1;
+		const std::size_t count = m_locked ? 64 : 1;
+		m_shards.clear();
+		while(m_shards.size() < count){ m_shards.emplace_back(new Shard()); }
+	}
+
+	bool insert(const T *p){
+		auto &shard = shard_of(p);
+		if(!m_locked){ return shard.set.insert(p); }
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		return shard.set.insert(p);
+	}
+
+	bool contains(const T *p){
+		auto &shard = shard_of(p);
+		if(!m_locked){ return shard.set.contains(p); }
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		return shard.set.contains(p);
+	}
+
+	// Not to be called while other threads insert
+	template <typename F>
+	void for_each(F f) const {
+		for(const auto &shard : m_shards){ shard->set.for_each(f); }
+	}
+
+	void clear(){
+		for(auto &shard : m_shards){ shard->set.clear(); }
+	}
+
+};
+
+#endif
@@ -1,38 +1,866 @@
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallString.h>
 #include <clang/AST/ExprCXX.h>
 #include <clang/AST/DeclCXX.h>
 #include <clang/AST/DeclTemplate.h>
+#include <clang/AST/RecursiveASTVisitor.h>
+#include <clang/Index/USRGeneration.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/Preprocessor.h>
 #include "reachability_analyzer.hpp"
+#include "reachability_index.hpp"
+#include "location_table.hpp"
+#include "pointer_set.hpp"
 
 // #define DEBUG_DUMP_AST
 
+template <typename... Ts>
+struct TypeList { };
+
+// ノードの型 T が Handlers の i 番目を継承しているとき i ビット目が立つ
+template <typename T, typename Handlers>
+struct HandlerMask;
+
+template <typename T>
+struct HandlerMask<T, TypeList<>> {
+	static const unsigned int value = 0u;
+};
+
+template <typename T, typename H, typename... Rest>
+struct HandlerMask<T, TypeList<H, Rest...>> {
+	static const unsigned int value =
+		(std::is_base_of<H, T>::value ? 1u : 0u) |
+		(HandlerMask<T, TypeList<Rest...>>::value << 1);
+};
+
+// TraverseDetail を持つノードの型 (呼び出し順)
+using DeclHandlers = TypeList<
+	clang::NamespaceDecl,
+	clang::TypedefNameDecl,
+	clang::CXXRecordDecl,
+	clang::ClassTemplateSpecializationDecl,
+	clang::TemplateDecl,
+	clang::ClassTemplateDecl,
+	clang::ValueDecl,
+	clang::FieldDecl,
+	clang::FunctionDecl,
+	clang::CXXConstructorDecl,
+	clang::VarDecl,
+	clang::ParmVarDecl>;
+
+using StmtHandlers = TypeList<
+	clang::DeclStmt,
+	clang::DeclRefExpr,
+	clang::MemberExpr,
+	clang::CallExpr,
+	clang::CXXConstructExpr,
+	clang::ExplicitCastExpr,
+	clang::UnaryExprOrTypeTraitExpr>;
+
+using TypeHandlers = TypeList<
+	clang::PointerType,
+	clang::ReferenceType,
+	clang::ArrayType,
+	clang::VariableArrayType,
+	clang::AttributedType,
+	clang::AutoType,
+	clang::DecltypeType,
+	clang::RecordType,
+	clang::TypedefType,
+	clang::TemplateSpecializationType,
+	clang::ElaboratedType>;
+
+// 種別ごとのマスクは switch から定数表として引かれる
+static unsigned int handler_mask(const clang::Decl *decl){
+	switch(decl->getKind()){
+#define ABSTRACT_DECL(DECL)
+#define DECL(DERIVED, BASE) \
+		case clang::Decl::DERIVED: \
+			return HandlerMask<clang::DERIVED##Decl, DeclHandlers>::value;
+#include <clang/AST/DeclNodes.inc>
+	}
+	return 0u;
+}
+
+static unsigned int handler_mask(const clang::Stmt *stmt){
+	switch(stmt->getStmtClass()){
+		case clang::Stmt::NoStmtClass:
+			return 0u;
+#define ABSTRACT_STMT(STMT)
+#define STMT(CLASS, PARENT) \
+		case clang::Stmt::CLASS##Class: \
+			return HandlerMask<clang::CLASS, StmtHandlers>::value;
+#include <clang/AST/StmtNodes.inc>
+	}
+	return 0u;
+}
+
+static unsigned int handler_mask(const clang::Type *type){
+	switch(type->getTypeClass()){
+#define ABSTRACT_TYPE(CLASS, BASE)
+#define TYPE(CLASS, BASE) \
+		case clang::Type::CLASS: \
+			return HandlerMask<clang::CLASS##Type, TypeHandlers>::value;
+#include <clang/AST/TypeNodes.def>
+	}
+	return 0u;
+}
+
+// リテラルだけからなる式 (埋め込まれた表の初期化子など) は宣言にも型にも到達しない
+static bool is_inert(const clang::Stmt *stmt){
+	while(true){
+		switch(stmt->getStmtClass()){
+			case clang::Stmt::IntegerLiteralClass:
+			case clang::Stmt::FloatingLiteralClass:
+			case clang::Stmt::CharacterLiteralClass:
+			case clang::Stmt::StringLiteralClass:
+			case clang::Stmt::CXXBoolLiteralExprClass:
+			case clang::Stmt::CXXNullPtrLiteralExprClass:
+			case clang::Stmt::ImplicitValueInitExprClass:
+				return true;
+			// 組み込みの演算子と暗黙の変換 (ユーザ定義の変換は子に呼び出しを持つ)
+			case clang::Stmt::ImplicitCastExprClass:
+				stmt = clang::cast<clang::ImplicitCastExpr>(stmt)->getSubExpr();
+				break;
+			case clang::Stmt::ParenExprClass:
+				stmt = clang::cast<clang::ParenExpr>(stmt)->getSubExpr();
+				break;
+			case clang::Stmt::UnaryOperatorClass:
+				stmt = clang::cast<clang::UnaryOperator>(stmt)->getSubExpr();
+				break;
+			case clang::Stmt::InitListExprClass:
+				for(const auto child : stmt->children()){
+					if(child && !is_inert(child)){ return false; }
+				}
+				return true;
+			default:
+				return false;
+		}
+	}
+}
+
+// インクルード指令に書かれた名前
+struct IncludedName {
+	std::string name;
+	bool angled;
+};
+
+// FileID のハッシュ値 -> そのファイルを取り込んだ指令の名前
+using IncludedNames = std::unordered_map<unsigned int, IncludedName>;
+
+// インクルード指令の綴りをその行から読む。プリコンパイル済みヘッダから
+// 読み込まれたファイルは指令の通知がないため、これで補う。そのヘッダの
+// 主ファイルは角括弧の指令を一行に一つずつ並べて生成したものである
+static bool included_name(
+	const clang::SourceManager &sm,
+	clang::SourceLocation include_loc,
+	std::string &name,
+	bool &angled)
+{
+	const auto decomposed = sm.getDecomposedLoc(sm.getExpansionLoc(include_loc));
+	bool invalid = false;
+	const auto text = sm.getBufferData(decomposed.first, &invalid);
+	if(invalid || decomposed.second > text.size()){ return false; }
+	const auto line_begin =
+		text.substr(0, decomposed.second).rfind('\n') + 1;
+	const auto line = text.substr(line_begin).split('\n').first;
+	const auto directive = line.find("include");
+	if(directive == llvm::StringRef::npos){ return false; }
+	// マクロで綴られた指令は読めない
+	const auto open = line.find_first_of("<\"", directive);
+	if(open == llvm::StringRef::npos){ return false; }
+	angled = (line[open] == '<');
+	const auto close = line.find(angled ? '>' : '"', open + 1);
+	if(close == llvm::StringRef::npos){ return false; }
+	name = line.slice(open + 1, close).str();
+	return true;
+}
+
+// loc を含むファイルを出力に持ち込む角括弧のインクルードを求める。
+// 展開は主ファイルから引用符のインクルードだけをたどるので、主ファイルに
+// 最も近い角括弧のインクルードが持ち上げられる。システムヘッダかどうかは
+// 問わない。引用符だけで到達するファイルは展開されるため name は空になる
+static bool top_level_header(
+	const clang::SourceManager &sm,
+	const IncludedNames &names,
+	clang::SourceLocation loc,
+	std::string &name)
+{
+	name.clear();
+	auto file_id = sm.getFileID(sm.getExpansionLoc(loc));
+	auto include_loc = sm.getIncludeLoc(file_id);
+	while(include_loc.isValid()){
+		std::string spelling;
+		bool angled = false;
+		const auto it = names.find(file_id.getHashValue());
+		if(it != names.end()){
+			spelling = it->second.name;
+			angled = it->second.angled;
+		}else if(
+			!sm.isLoadedFileID(file_id) ||
+			!included_name(sm, include_loc, spelling, angled))
+		{
+			return false;
+		}
+		if(angled){ name = std::move(spelling); }
+		file_id = sm.getFileID(include_loc);
+		include_loc = sm.getIncludeLoc(file_id);
+	}
+	return true;
+}
+
+// スレッドごとの作業キュー。持ち主は末尾から、他のスレッドは先頭から取る
+template <typename T>
+class WorkStealingQueue {
+
+private:
+	std::mutex m_mutex;
+	std::deque<T> m_items;
+
+public:
+	void push(const T &item){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_items.push_back(item);
+	}
+
+	bool pop(T &item){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(m_items.empty()){ return false; }
+		item = m_items.back();
+		m_items.pop_back();
+		return true;
+	}
+
+	bool steal(T &item){
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(m_items.empty()){ return false; }
+		item = m_items.front();
+		m_items.pop_front();
+		return true;
+	}
+
+};
+
+// 式の種類とソース上の範囲。インスタンス化された式は元の式の位置を引き継ぐ
+struct ExprKey {
+	unsigned int stmt_class;
+	unsigned int begin;
+	unsigned int end;
+
+	bool operator==(const ExprKey &other) const {
+		return stmt_class == other.stmt_class
+			&& begin == other.begin
+			&& end == other.end;
+	}
+};
+
+struct ExprKeyHash {
+	std::size_t operator()(const ExprKey &key) const {
+		std::size_t h = key.stmt_class;
+		h = h * 0x9e3779b97f4a7c15ull + key.begin;
+		h = h * 0x9e3779b97f4a7c15ull + key.end;
+		return h ^ (h >> 29);
+	}
+};
+
+using ExprKeySet = std::unordered_set<ExprKey, ExprKeyHash>;
+
 class ReachabilityAnalyzer::ASTConsumer : public clang::ASTConsumer {
 
 private:
 	const clang::SourceManager *m_source_manager;
-	std::unordered_set<const clang::Decl *> m_traversed_decls;
-	std::unordered_set<const clang::Stmt *> m_traversed_stmts;
-	std::unordered_set<const clang::Type *> m_traversed_types;
+	const clang::LangOptions *m_lang_options;
+	ConcurrentPointerSet<clang::Decl> m_traversed_decls;
+	// 文は子としてたどる限り木構造なので、他から到達した根だけを記録する
+	// (DeclStmt の子は宣言と共有されるため、宣言の側からだけたどる。
+	//  ラムダ式の本体は operator() の本体でもあるため、根として記録する)
+	ConcurrentPointerSet<clang::Stmt> m_traversed_stmts;
+	ConcurrentPointerSet<clang::Type> m_traversed_types;
 
-	std::shared_ptr<ReachabilityMarker> m_marker;
+	// 走査待ちのノード (訪問済みの印は積む時点で付ける)
+	struct WorkItem {
+		enum Kind { DECL, STMT, TYPE } kind;
+		const void *node;
+		int depth;
+		// 辿らなくてよい子の式 (テンプレートの二つ目以降のインスタンス)
+		const ExprKeySet *skip;
+	};
+	std::vector<WorkItem> m_worklist;
 
-	void reset(){
+	// 並列走査時の状態。作業キューはスレッドごとに持つ
+	using WorkQueue = WorkStealingQueue<WorkItem>;
+	static thread_local WorkQueue *s_current_queue;
+	std::atomic<std::size_t> m_pending_items;
+	bool m_parallel;
+	// 名前探索の遅延構築や表の更新は排他が必要
+	mutable std::mutex m_shared_mutex;
+	// 並列に辿る間の位置の問い合わせは写しから答える
+	LocationTable m_locations;
+
+	// 関数テンプレートのパターンごとの状態
+	struct PatternState {
+		// インスタンスの本体を一度辿ったか
+		bool traversed;
+		bool scanned;
+		// パターンの本体のうちテンプレート引数に依存しない極大な式
+		ExprKeySet independent_exprs;
+	};
+	std::unordered_map<const clang::FunctionDecl *, PatternState> m_patterns;
+
+	// システムヘッダ内の特殊化がユーザコードを引数に取るか
+	std::unordered_map<const clang::Decl *, bool> m_user_specializations;
+
+	// 索引の宣言番号と現在の AST 上の宣言の対応
+	std::unordered_map<const clang::Decl *, unsigned int> m_index_ids;
+	std::vector<llvm::SmallVector<const clang::Decl *, 1>> m_indexed_decls;
+	// 索引の単位ごとの状態 (0: 未確認, 1: 有効, 2: ファイルが変更された)
+	std::vector<int> m_unit_states;
+	// FileID ごとの索引のファイル番号 (索引外なら -1)
+	std::unordered_map<unsigned int, int> m_index_files;
+
+	std::shared_ptr<ReachabilityMarkers> m_markers;
+	std::shared_ptr<const IncludedNames> m_included_names;
+
+	// 印付けで使う宣言ごとの位置の表
+	struct DeclLines {
+		// 同じファイル内で次に現れる明示的な宣言
+		const clang::Decl *next;
+		// DeclEnd の結果 (未計算なら無効な位置)
+		clang::SourceLocation end;
+	};
+	// 印付けの状態。並列時はスレッドごとに持ち、最後に m_markers へ合わせる
+	struct MarkingState {
+		ReachabilityMarkers *markers;
+		std::unordered_map<unsigned int, ReachabilityMarker *> file_markers;
+		llvm::DenseMap<const clang::Decl *, DeclLines> decl_lines;
+		llvm::DenseSet<const clang::DeclContext *> filled_contexts;
+	};
+	MarkingState m_marking;
+	static thread_local MarkingState *s_current_marking;
+
+	ReachabilityAnalyzerOptions m_options;
+
+	void ClearTraversal(){
 		m_traversed_decls.clear();
 		m_traversed_stmts.clear();
 		m_traversed_types.clear();
+		m_worklist.clear();
+		m_patterns.clear();
+	}
+
+	void reset(){
+		ClearTraversal();
+		m_pending_items = 0;
+		m_parallel = false;
+		m_user_specializations.clear();
+		m_index_ids.clear();
+		m_indexed_decls.clear();
+		m_unit_states.clear();
+		m_index_files.clear();
+		m_locations.clear();
+		m_marking.markers = m_markers.get();
+		m_marking.file_markers.clear();
+		m_marking.decl_lines.clear();
+		m_marking.filled_contexts.clear();
+	}
+
+	template <typename U>
+	void Dispatch(const U *, unsigned int, int, TypeList<>){ }
+
+	template <typename U, typename T, typename... Rest>
+	void Dispatch(const U *node, unsigned int mask, int depth, TypeList<T, Rest...>){
+		if(mask & 1u){ TraverseDetail(clang::cast<T>(node), depth + 1); }
+		if(mask >> 1){ Dispatch(node, mask >> 1, depth, TypeList<Rest...>()); }
+	}
+
+	void Push(const WorkItem &item){
+		if(!s_current_queue){
+			m_worklist.push_back(item);
+			return;
+		}
+		// 処理中の要素より先に数えるので、残数は仕事が尽きるまで 0 にならない
+		++m_pending_items;
+		s_current_queue->push(item);
+	}
+
+	void Visit(const WorkItem &item){
+		switch(item.kind){
+			case WorkItem::DECL:
+				Visit(static_cast<const clang::Decl *>(item.node), item.depth);
+				break;
+			case WorkItem::STMT:
+				Visit(static_cast<const clang::Stmt *>(item.node), item.depth, item.skip);
+				break;
+			case WorkItem::TYPE:
+				Visit(static_cast<const clang::Type *>(item.node), item.depth);
+				break;
+		}
+	}
+
+	std::unique_lock<std::mutex> LockShared() const {
+		std::unique_lock<std::mutex> lock(m_shared_mutex, std::defer_lock);
+		if(m_parallel){ lock.lock(); }
+		return lock;
+	}
+
+	void Drain(){
+		while(!m_worklist.empty()){
+			const auto item = m_worklist.back();
+			m_worklist.pop_back();
+			Visit(item);
+		}
+	}
+
+	// 根を各スレッドに配り、空いたスレッドは他のキューから盗む
+	void DrainParallel(unsigned int jobs){
+		m_parallel = true;
+		std::vector<WorkQueue> queues(jobs);
+		m_pending_items = m_worklist.size();
+		for(std::size_t i = 0; i < m_worklist.size(); ++i){
+			queues[i % jobs].push(m_worklist[i]);
+		}
+		m_worklist.clear();
+		const auto work = [this, &queues, jobs](unsigned int index){
+			s_current_queue = &queues[index];
+			WorkItem item;
+			while(m_pending_items > 0){
+				bool found = queues[index].pop(item);
+				for(unsigned int i = 1; !found && i < jobs; ++i){
+					found = queues[(index + i) % jobs].steal(item);
+				}
+				if(!found){
+					std::this_thread::yield();
+					continue;
+				}
+				Visit(item);
+				--m_pending_items;
+			}
+			s_current_queue = nullptr;
+		};
+		std::vector<std::thread> threads;
+		for(unsigned int i = 1; i < jobs; ++i){ threads.emplace_back(work, i); }
+		work(0);
+		for(auto &t : threads){ t.join(); }
+		m_parallel = false;
+	}
+
+	// 並列に辿る前に、遅延構築される状態を作っておく
+	void PrepareParallel(const clang::TranslationUnitDecl *tu){
+		m_locations.build(*m_source_manager);
+		PrepareTemplates(tu);
+	}
+
+	// テンプレートの共有情報 (getCommonPtr) は初めて問われたときに作られる。
+	// 関数の中にはメンバテンプレートを持つクラスを書けないので、本体は見ない
+	static void PrepareTemplates(const clang::DeclContext *context){
+		for(const auto child : context->decls()){
+			const clang::Decl *decl = child;
+			if(const auto t = clang::dyn_cast<clang::RedeclarableTemplateDecl>(decl)){
+				t->getInstantiatedFromMemberTemplate();
+				if(const auto class_template = clang::dyn_cast<clang::ClassTemplateDecl>(t)){
+					for(const auto spec : class_template->specializations()){
+						PrepareTemplates(spec);
+					}
+				}
+				decl = t->getTemplatedDecl();
+			}
+			if(!decl || clang::isa<clang::FunctionDecl>(decl)){ continue; }
+			if(const auto inner = clang::dyn_cast<clang::DeclContext>(decl)){
+				PrepareTemplates(inner);
+			}
+		}
+	}
+
+	// 最上位の宣言を各スレッドが順に取り、それぞれの印を最後に合わせる。
+	// 印付けは範囲を加えるだけなので、和は逐次に印付けた結果と一致する
+	void MarkParallel(const clang::TranslationUnitDecl *tu, unsigned int jobs){
+		m_parallel = true;
+		const std::vector<const clang::Decl *> decls(tu->decls_begin(), tu->decls_end());
+		std::vector<ReachabilityMarkers> markers(jobs);
+		std::atomic<std::size_t> next(0);
+		const auto work = [this, &decls, &markers, &next](unsigned int index){
+			MarkingState state;
+			state.markers = &markers[index];
+			s_current_marking = &state;
+			for(std::size_t i = next++; i < decls.size(); i = next++){
+				MarkRecursive(decls[i], 0);
+			}
+			s_current_marking = nullptr;
+		};
+		std::vector<std::thread> threads;
+		for(unsigned int i = 1; i < jobs; ++i){ threads.emplace_back(work, i); }
+		work(0);
+		for(auto &t : threads){ t.join(); }
+		m_parallel = false;
+		for(const auto &thread_markers : markers){
+			for(const auto &file : thread_markers){
+				auto &marker = (*m_markers)[file.first];
+				for(const auto &range : file.second){
+					marker.mark(range.first, range.second);
+				}
+			}
+		}
+	}
+
+	MarkingState &Marking(){
+		return s_current_marking ? *s_current_marking : m_marking;
+	}
+
+	clang::FileID FileOf(const clang::SourceLocation &loc) const {
+		clang::FileID file_id;
+		unsigned int offset = 0;
+		if(m_locations.decompose(loc, file_id, offset)){ return file_id; }
+		const auto lock = LockShared();
+		return m_source_manager->getFileID(
+			m_source_manager->getExpansionLoc(loc));
+	}
+
+	unsigned int Offset(const clang::SourceLocation &loc) const {
+		clang::FileID file_id;
+		unsigned int offset = 0;
+		if(m_locations.decompose(loc, file_id, offset)){ return offset; }
+		const auto lock = LockShared();
+		return m_source_manager->getFileOffset(
+			m_source_manager->getExpansionLoc(loc));
+	}
+
+	// loc から始まるトークンの直後
+	clang::SourceLocation EndOfToken(const clang::SourceLocation &loc) const {
+		clang::SourceLocation end;
+		if(!m_locations.end_of_token(loc, *m_lang_options, end)){
+			const auto lock = LockShared();
+			end = clang::Lexer::getLocForEndOfToken(
+				m_source_manager->getExpansionLoc(loc), 0,
+				*m_source_manager, *m_lang_options);
+		}
+		return end.isValid() ? end : loc;
+	}
+
+	llvm::StringRef BufferData(const clang::FileID &file_id) const {
+		if(const auto file = m_locations.file(file_id)){ return file->text; }
+		const auto lock = LockShared();
+		return m_source_manager->getBufferData(file_id);
+	}
+
+	clang::SourceLocation EndOfFile(const clang::FileID &file_id) const {
+		if(const auto file = m_locations.file(file_id)){
+			return file->start.getLocWithOffset(file->text.size());
+		}
+		const auto lock = LockShared();
+		return m_source_manager->getLocForEndOfFile(file_id);
+	}
+
+	//------------------------------------------------------------------------
+	// Traversal boundary
+	//------------------------------------------------------------------------
+	bool IsUserDecl(const clang::Decl *decl) const {
+		if(!decl){ return false; }
+		bool system = false;
+		if(m_locations.is_in_system_header(decl->getLocation(), system)){
+			return !system;
+		}
+		const auto lock = LockShared();
+		return !m_source_manager->isInSystemHeader(
+			m_source_manager->getExpansionLoc(decl->getLocation()));
+	}
+
+	bool MentionsUserCode(const clang::QualType &qual_type) const {
+		if(qual_type.isNull()){ return false; }
+		const auto type = qual_type.getCanonicalType().getTypePtr();
+		if(const auto tag = type->getAsTagDecl()){
+			if(IsUserDecl(tag)){ return true; }
+			// std::vector<std::pair<A, int>> のような入れ子
+			const auto spec =
+				clang::dyn_cast<clang::ClassTemplateSpecializationDecl>(tag);
+			return spec && MentionsUserCode(spec->getTemplateArgs().asArray());
+		}
+		// ポインタ, 参照, メンバポインタ
+		if(!type->getPointeeType().isNull()){
+			if(const auto member = type->getAs<clang::MemberPointerType>()){
+				if(MentionsUserCode(clang::QualType(member->getClass(), 0))){
+					return true;
+				}
+			}
+			return MentionsUserCode(type->getPointeeType());
+		}
+		if(const auto array = type->getAsArrayTypeUnsafe()){
+			return MentionsUserCode(array->getElementType());
+		}
+		if(const auto func = type->getAs<clang::FunctionProtoType>()){
+			if(MentionsUserCode(func->getReturnType())){ return true; }
+			for(const auto &param : func->getParamTypes()){
+				if(MentionsUserCode(param)){ return true; }
+			}
+		}
+		return false;
+	}
+
+	bool MentionsUserCode(llvm::ArrayRef<clang::TemplateArgument> args) const {
+		for(const auto &arg : args){
+			switch(arg.getKind()){
+				case clang::TemplateArgument::Type:
+					if(MentionsUserCode(arg.getAsType())){ return true; }
+					break;
+				case clang::TemplateArgument::Declaration:
+					if(IsUserDecl(arg.getAsDecl())){ return true; }
+					break;
+				case clang::TemplateArgument::Template:
+				case clang::TemplateArgument::TemplateExpansion:
+					if(IsUserDecl(arg.getAsTemplateOrTemplatePattern()
+						.getAsTemplateDecl()))
+					{
+						return true;
+					}
+					break;
+				case clang::TemplateArgument::Expression:
+					// 依存した式は判断できないので辿る
+					return true;
+				case clang::TemplateArgument::Pack:
+					if(MentionsUserCode(arg.pack_elements())){ return true; }
+					break;
+				default:
+					break;
+			}
+		}
+		return false;
+	}
+
+	bool IsUserSpecialization(const clang::Decl *decl){
+		{
+			const auto lock = LockShared();
+			const auto it = m_user_specializations.find(decl);
+			if(it != m_user_specializations.end()){ return it->second; }
+		}
+		// 判定は表の外で行う (複数のスレッドが同じ結果を求めることはある)
+		bool result = false;
+		if(const auto spec =
+			clang::dyn_cast<clang::ClassTemplateSpecializationDecl>(decl))
+		{
+			result = MentionsUserCode(spec->getTemplateArgs().asArray());
+		}else if(const auto func = clang::dyn_cast<clang::FunctionDecl>(decl)){
+			const auto args = func->getTemplateSpecializationArgs();
+			result = args && MentionsUserCode(args->asArray());
+		}
+		const auto lock = LockShared();
+		m_user_specializations.emplace(decl, result);
+		return result;
+	}
+
+	// システムヘッダの定義は葉として扱う。ただしユーザの型や関数を引数とする
+	// 特殊化 (およびその中の定義) はユーザコードを呼び戻し得るので辿る。
+	bool IsBoundary(const clang::Decl *decl){
+		if(IsUserDecl(decl)){ return false; }
+		for(auto d = decl; d; ){
+			if(IsUserSpecialization(d)){ return false; }
+			const auto ctx = d->getDeclContext();
+			d = ctx ? clang::dyn_cast<clang::Decl>(ctx) : nullptr;
+		}
+		return true;
+	}
+
+	//------------------------------------------------------------------------
+	// Index
+	//------------------------------------------------------------------------
+	// MarkRecursive が辿る宣言を列挙する
+	void CollectMarkable(
+		const clang::Decl *decl,
+		std::vector<const clang::Decl *> &result)
+	{
+		result.push_back(decl);
+		if(
+			clang::isa<clang::NamespaceDecl>(decl) ||
+			clang::isa<clang::RecordDecl>(decl))
+		{
+			const auto context = clang::dyn_cast<clang::DeclContext>(decl);
+			for(const auto child : context->decls()){
+				CollectMarkable(child, result);
+			}
+		}else if(const auto class_template =
+			clang::dyn_cast<clang::ClassTemplateDecl>(decl))
+		{
+			CollectMarkable(class_template->getTemplatedDecl(), result);
+			for(const auto spec : class_template->specializations()){
+				CollectMarkable(spec, result);
+			}
+		}else if(const auto function_template =
+			clang::dyn_cast<clang::FunctionTemplateDecl>(decl))
+		{
+			CollectMarkable(function_template->getTemplatedDecl(), result);
+			for(const auto spec : function_template->specializations()){
+				CollectMarkable(spec, result);
+			}
+		}
+	}
+
+	bool FileContentHash(const clang::FileEntry *entry, std::string &hash){
+		auto &fm = m_source_manager->getFileManager();
+		const auto buffer = fm.getBufferForFile(entry);
+		if(!buffer){ return false; }
+		hash = ReachabilityIndex::content_hash((*buffer)->getBuffer());
+		return true;
+	}
+
+	// 索引の対象ディレクトリにあるファイルの番号
+	int IndexFileOf(const clang::Decl *decl){
+		const auto file_id = FileOf(decl->getLocation());
+		const auto it = m_index_files.find(file_id.getHashValue());
+		if(it != m_index_files.end()){ return it->second; }
+		int result = -1;
+		auto &index = *m_options.index;
+		const auto entry = m_source_manager->getFileEntryForID(file_id);
+		const auto path = entry
+			? ReachabilityIndex::normalize_path(entry->getName())
+			: std::string();
+		if(entry && index.contains(path)){
+			if(m_options.build_index){
+				std::string hash;
+				if(FileContentHash(entry, hash)){
+					result = static_cast<int>(index.add_file(path, hash));
+				}
+			}else{
+				const auto found = index.file_ids.find(path);
+				if(found != index.file_ids.end()){
+					result = static_cast<int>(found->second);
+				}
+			}
+		}
+		m_index_files.emplace(file_id.getHashValue(), result);
+		return result;
+	}
+
+	// 再宣言を区別するため、USR に位置を加えたものを鍵とする
+	bool DeclarationKey(const clang::Decl *decl, std::string &key){
+		const auto file = IndexFileOf(decl);
+		if(file < 0){ return false; }
+		llvm::SmallString<128> usr;
+		if(clang::index::generateUSRForDecl(decl, usr)){ return false; }
+		const auto offset = m_source_manager->getFileOffset(
+			m_source_manager->getExpansionLoc(decl->getLocation()));
+		key = ReachabilityIndex::declaration_key(file, offset, usr);
+		return true;
+	}
+
+	// 主ファイルとして解析したヘッダの各宣言について閉包を求める
+	void BuildIndex(clang::ASTContext &context){
+		if(context.getDiagnostics().hasErrorOccurred()){ return; }
+		auto &index = *m_options.index;
+		const auto unit = static_cast<int>(index.units.size());
+		index.units.emplace_back();
+		for(auto it = m_source_manager->fileinfo_begin();
+		    it != m_source_manager->fileinfo_end(); ++it)
+		{
+			const auto path =
+				ReachabilityIndex::normalize_path(it->first->getName());
+			if(!index.contains(path)){ continue; }
+			std::string hash;
+			if(!FileContentHash(it->first, hash)){ return; }
+			index.units.back().files.push_back(index.add_file(path, hash));
+		}
+
+		std::vector<const clang::Decl *> markable;
+		for(const auto decl : context.getTranslationUnitDecl()->decls()){
+			CollectMarkable(decl, markable);
+		}
+		std::vector<std::pair<const clang::Decl *, unsigned int>> library;
+		std::vector<const clang::Decl *> unkeyed;
+		for(const auto decl : markable){
+			std::string key;
+			if(DeclarationKey(decl, key)){
+				library.emplace_back(decl, index.add_declaration(key));
+			}else if(IndexFileOf(decl) >= 0){
+				unkeyed.push_back(decl);
+			}
+		}
+
+		const auto main_file = m_source_manager->getMainFileID();
+		for(const auto &root : library){
+			if(FileOf(root.first->getLocation()) != main_file){ continue; }
+			if(index.declarations[root.second].unit >= 0){ continue; }
+			ClearTraversal();
+			Traverse(root.first, 0);
+			Drain();
+			// 鍵を作れない宣言に到達する場合は索引に載せない
+			bool complete = true;
+			for(const auto decl : unkeyed){
+				if(m_traversed_decls.contains(decl)){ complete = false; }
+			}
+			if(!complete){ continue; }
+			llvm::BitVector closure(index.declarations.size());
+			for(const auto &decl : library){
+				if(m_traversed_decls.contains(decl.first)){
+					closure.set(decl.second);
+				}
+			}
+			auto &entry = index.declarations[root.second];
+			entry.unit = unit;
+			entry.closure = std::move(closure);
+		}
 	}
 
-	template <typename T, typename U>
-	void TestAndTraverse(U *node, int depth){
-		if(clang::isa<T>(node)){
-			TraverseDetail(clang::dyn_cast<T>(node), depth + 1);
+	void PrepareIndex(const clang::TranslationUnitDecl *tu){
+		if(!m_options.index){ return; }
+		const auto &index = *m_options.index;
+		m_indexed_decls.assign(index.declarations.size(), {});
+		m_unit_states.assign(index.units.size(), 0);
+		std::vector<const clang::Decl *> markable;
+		for(const auto decl : tu->decls()){ CollectMarkable(decl, markable); }
+		for(const auto decl : markable){
+			std::string key;
+			if(!DeclarationKey(decl, key)){ continue; }
+			const auto it = index.declaration_ids.find(key);
+			if(it == index.declaration_ids.end()){ continue; }
+			m_indexed_decls[it->second].push_back(decl);
+			m_index_ids.emplace(decl, it->second);
 		}
 	}
 
-	clang::SourceLocation PreviousLine(const clang::SourceLocation &loc){
-		const int col = m_source_manager->getPresumedColumnNumber(loc);
-		return loc.getLocWithOffset(-col);
+	bool IsValidUnit(unsigned int unit){
+		const auto lock = LockShared();
+		auto &state = m_unit_states[unit];
+		if(state != 0){ return state == 1; }
+		state = 1;
+		const auto &index = *m_options.index;
+		auto &fm = m_source_manager->getFileManager();
+		for(const auto file : index.units[unit].files){
+			const auto entry = fm.getFile(index.files[file].path);
+			std::string hash;
+			if(!entry || !FileContentHash(entry, hash) ||
+			   hash != index.files[file].hash)
+			{
+				state = 2;
+				break;
+			}
+		}
+		return state == 1;
+	}
+
+	// 索引に閉包がある宣言はその先を辿らず、閉包全体を訪問済みにする
+	bool TraverseIndexed(const clang::Decl *decl){
+		if(m_index_ids.empty()){ return false; }
+		const auto it = m_index_ids.find(decl);
+		if(it == m_index_ids.end()){ return false; }
+		const auto &entry = m_options.index->declarations[it->second];
+		if(entry.unit < 0 || !IsValidUnit(entry.unit)){ return false; }
+		for(const auto i : entry.closure.set_bits()){
+			if(m_indexed_decls[i].empty()){ return false; }
+		}
+		for(const auto i : entry.closure.set_bits()){
+			for(const auto d : m_indexed_decls[i]){ m_traversed_decls.insert(d); }
+		}
+		return true;
 	}
 
 	//------------------------------------------------------------------------
@@ -40,7 +868,11 @@ private:
 	//------------------------------------------------------------------------
 	void Traverse(const clang::Decl *decl, int depth){
 		if(!decl){ return; }
-		if(!m_traversed_decls.insert(decl).second){ return; }
+		if(!m_traversed_decls.insert(decl)){ return; }
+		Push(WorkItem{ WorkItem::DECL, decl, depth, nullptr });
+	}
+
+	void Visit(const clang::Decl *decl, int depth){
 #ifdef DEBUG_DUMP_AST
 		std::cerr << std::string(depth * 2, ' ')
 		          << "D: " << decl->getDeclKindName();
@@ -61,6 +893,8 @@ private:
 			          << std::endl;
 		}
 #endif
+		if(IsBoundary(decl)){ return; }
+		if(TraverseIndexed(decl)){ return; }
 		{	// 親の定義
 			const auto ctx = decl->getDeclContext();
 			if(ctx && clang::isa<clang::Decl>(ctx)){
@@ -68,20 +902,7 @@ private:
 			}
 		}
 
-		TestAndTraverse<clang::NamespaceDecl>(decl, depth);
-
-		TestAndTraverse<clang::TypedefNameDecl>(decl, depth);
-		TestAndTraverse<clang::CXXRecordDecl>(decl, depth);
-		TestAndTraverse<clang::ClassTemplateSpecializationDecl>(decl, depth);
-		TestAndTraverse<clang::TemplateDecl>(decl, depth);
-		TestAndTraverse<clang::ClassTemplateDecl>(decl, depth);
-
-		TestAndTraverse<clang::ValueDecl>(decl, depth);
-		TestAndTraverse<clang::FieldDecl>(decl, depth);
-		TestAndTraverse<clang::FunctionDecl>(decl, depth);
-		TestAndTraverse<clang::CXXConstructorDecl>(decl, depth);
-		TestAndTraverse<clang::VarDecl>(decl, depth);
-		TestAndTraverse<clang::ParmVarDecl>(decl, depth);
+		Dispatch(decl, handler_mask(decl), depth, DeclHandlers());
 	}
 
 	void TraverseDetail(const clang::NamespaceDecl *decl, int depth){
@@ -110,7 +931,13 @@ private:
 		for(const auto &vbase : decl->vbases()){ Traverse(vbase.getType(), depth); }
 		// ユーザ定義デストラクタ
 		if(decl->hasUserDeclaredDestructor()){
-			Traverse(decl->getDestructor(), depth);
+			// getDestructor は探索表を遅延構築し得る
+			const clang::Decl *destructor = nullptr;
+			{
+				const auto lock = LockShared();
+				destructor = decl->getDestructor();
+			}
+			Traverse(destructor, depth);
 		}
 	}
 	void TraverseDetail(const clang::ClassTemplateSpecializationDecl *decl, int depth){
@@ -156,7 +983,7 @@ private:
 			Traverse(decl->getParamDecl(i), depth);
 		}
 		// 処理内容
-		if(decl->hasBody()){ Traverse(decl->getBody(), depth); }
+		if(decl->hasBody()){ TraverseBody(decl, depth); }
 		// 戻り値の型
 		Traverse(decl->getReturnType(), depth);
 	}
@@ -183,23 +1010,90 @@ private:
 	//------------------------------------------------------------------------
 	// Statements
 	//------------------------------------------------------------------------
-	void Traverse(const clang::Stmt *stmt, int depth){
-		if(!stmt){ return; }
-		if(!m_traversed_stmts.insert(stmt).second){ return; }
+	void Traverse(const clang::Stmt *stmt, int depth, const ExprKeySet *skip = nullptr){
+		if(!stmt || is_inert(stmt)){ return; }
+		if(!m_traversed_stmts.insert(stmt)){ return; }
+		Push(WorkItem{ WorkItem::STMT, stmt, depth, skip });
+	}
+
+	void TraverseChild(const clang::Stmt *stmt, int depth, const ExprKeySet *skip){
+		if(!stmt || is_inert(stmt)){ return; }
+		// OpaqueValueExpr は複数の親から共有される
+		if(clang::isa<clang::OpaqueValueExpr>(stmt)){
+			Traverse(stmt, depth);
+			return;
+		}
+		if(skip && clang::isa<clang::Expr>(stmt) && skip->count(KeyOf(stmt))){ return; }
+		Push(WorkItem{ WorkItem::STMT, stmt, depth, skip });
+	}
+
+	static ExprKey KeyOf(const clang::Stmt *stmt){
+		return ExprKey{
+			static_cast<unsigned int>(stmt->getStmtClass()),
+			stmt->getBeginLoc().getRawEncoding(),
+			stmt->getEndLoc().getRawEncoding() };
+	}
+
+	// テンプレート引数に依存しない式の参照先は二段階の名前探索により
+	// 定義の時点で決まり、どのインスタンスでも同じ宣言になる。
+	// 同じパターンの二つ目以降のインスタンスではそれらを辿り直さず、
+	// 引数に依存する部分だけを辿る
+	void TraverseBody(const clang::FunctionDecl *decl, int depth){
+		const auto body = decl->getBody();
+		const auto pattern = decl->getTemplateInstantiationPattern();
+		if(!pattern || pattern == decl || !pattern->hasBody()){
+			Traverse(body, depth);
+			return;
+		}
+		const ExprKeySet *skip = nullptr;
+		{
+			const auto lock = LockShared();
+			auto &state = m_patterns[pattern];
+			if(state.traversed){
+				if(!state.scanned){
+					ScanIndependentExprs(pattern->getBody(), state.independent_exprs);
+					state.scanned = true;
+				}
+				skip = &state.independent_exprs;
+			}
+			state.traversed = true;
+		}
+		Traverse(body, depth, skip);
+	}
+
+	static void ScanIndependentExprs(const clang::Stmt *body, ExprKeySet &exprs){
+		std::vector<const clang::Stmt *> stack(1, body);
+		while(!stack.empty()){
+			const auto stmt = stack.back();
+			stack.pop_back();
+			const auto expr = clang::dyn_cast<clang::Expr>(stmt);
+			if(expr && !expr->isInstantiationDependent()){
+				exprs.insert(KeyOf(expr));
+				continue;
+			}
+			for(const auto child : stmt->children()){
+				if(child){ stack.push_back(child); }
+			}
+		}
+	}
+
+	void Visit(const clang::Stmt *stmt, int depth, const ExprKeySet *skip){
 #ifdef DEBUG_DUMP_AST
 		std::cerr << std::string(depth * 2, ' ')
 		          << "S: " << stmt->getStmtClassName() << std::endl;
 #endif
-		for(const auto child : stmt->children()){
-			Traverse(child, depth + 1);
+		// DeclStmt の子は変数の初期化式で、宣言の側からたどる
+		if(!clang::isa<clang::DeclStmt>(stmt)){
+			const auto lambda = clang::dyn_cast<clang::LambdaExpr>(stmt);
+			for(const auto child : stmt->children()){
+				if(lambda && child == lambda->getBody()){
+					Traverse(child, depth + 1, skip);
+				}else{
+					TraverseChild(child, depth + 1, skip);
+				}
+			}
 		}
-		TestAndTraverse<clang::DeclStmt>(stmt, depth);
-		TestAndTraverse<clang::DeclRefExpr>(stmt, depth);
-		TestAndTraverse<clang::MemberExpr>(stmt, depth);
-		TestAndTraverse<clang::CallExpr>(stmt, depth);
-		TestAndTraverse<clang::CXXConstructExpr>(stmt, depth);
-		TestAndTraverse<clang::ExplicitCastExpr>(stmt, depth);
-		TestAndTraverse<clang::UnaryExprOrTypeTraitExpr>(stmt, depth);
+		Dispatch(stmt, handler_mask(stmt), depth, StmtHandlers());
 	}
 
 	void TraverseDetail(const clang::DeclStmt *stmt, int depth){
@@ -253,21 +1147,16 @@ private:
 	}
 	void Traverse(const clang::Type *type, int depth){
 		if(!type){ return; }
-		if(!m_traversed_types.insert(type).second){ return; }
+		if(!m_traversed_types.insert(type)){ return; }
+		Push(WorkItem{ WorkItem::TYPE, type, depth, nullptr });
+	}
+
+	void Visit(const clang::Type *type, int depth){
 #ifdef DEBUG_DUMP_AST
 		std::cerr << std::string(depth * 2, ' ')
 		          << "T: " << type->getTypeClassName() << std::endl;
 #endif
-		TestAndTraverse<clang::PointerType>(type, depth);
-		TestAndTraverse<clang::ReferenceType>(type, depth);
-		TestAndTraverse<clang::ArrayType>(type, depth);
-		TestAndTraverse<clang::AttributedType>(type, depth);
-		TestAndTraverse<clang::AutoType>(type, depth);
-		TestAndTraverse<clang::DecltypeType>(type, depth);
-		TestAndTraverse<clang::RecordType>(type, depth);
-		TestAndTraverse<clang::TypedefType>(type, depth);
-		TestAndTraverse<clang::TemplateSpecializationType>(type, depth);
-		TestAndTraverse<clang::ElaboratedType>(type, depth);
+		Dispatch(type, handler_mask(type), depth, TypeHandlers());
 	}
 
 	void TraverseDetail(const clang::PointerType *type, int depth){
@@ -282,6 +1171,10 @@ private:
 		// 要素の型
 		Traverse(type->getElementType(), depth);
 	}
+	void TraverseDetail(const clang::VariableArrayType *type, int depth){
+		// 要素数の式 (DeclStmt の子としてはたどらない)
+		Traverse(type->getSizeExpr(), depth);
+	}
 	void TraverseDetail(const clang::AttributedType *type, int depth){
 		// 修飾された型
 		Traverse(type->getModifiedType(), depth);
@@ -386,8 +1279,31 @@ private:
 		}
 	}
 
+	ReachabilityMarker *FindMarker(const clang::FileID &file_id){
+		auto &state = Marking();
+		const auto it = state.file_markers.find(file_id.getHashValue());
+		if(it != state.file_markers.end()){ return it->second; }
+		ReachabilityMarker *marker = nullptr;
+		const clang::FileEntry *entry = nullptr;
+		bool system = false;
+		if(const auto file = m_locations.file(file_id)){
+			entry = file->entry;
+			system = file->system;
+		}else{
+			const auto lock = LockShared();
+			entry = m_source_manager->getFileEntryForID(file_id);
+			system = m_source_manager->isInSystemHeader(
+				m_source_manager->getLocForStartOfFile(file_id));
+		}
+		if(entry && !system){
+			marker = &(*state.markers)[entry->getName().str()];
+		}
+		state.file_markers.emplace(file_id.getHashValue(), marker);
+		return marker;
+	}
+
+	// 範囲 [begin, end) をバイト単位で印付ける
 	void MarkRange(const clang::SourceRange &range){
-		const auto main_file_id = m_source_manager->getMainFileID();
 		const auto begin = range.getBegin();
 		const auto end = range.getEnd();
 #ifdef DEBUG_DUMP_AST
@@ -398,13 +1314,17 @@ private:
 		          << range.getEnd().printToString(*m_source_manager)
 		          << std::endl;
 #endif
-		if(m_source_manager->getFileID(begin) != main_file_id){ return; }
-		const auto begin_line =
-			m_source_manager->getPresumedLineNumber(begin) - 1;
-		const auto end_line =
-			m_source_manager->getPresumedLineNumber(end) - 1;
-		for(unsigned int i = begin_line; i <= end_line; ++i){
-			m_marker->mark(i);
+		const auto file_id = FileOf(begin);
+		const auto marker = FindMarker(file_id);
+		if(!marker){ return; }
+		const auto begin_offset = Offset(begin);
+		if(FileOf(end) == file_id){
+			marker->mark(begin_offset, Offset(end));
+		}else{
+			// 終端が別のファイルにあるときは始点の行末まで
+			const auto text = BufferData(file_id);
+			const auto line_end = std::min(text.find('\n', begin_offset), text.size());
+			marker->mark(begin_offset, static_cast<unsigned int>(line_end));
 		}
 	}
 
@@ -415,7 +1335,8 @@ private:
 		MarkRange(clang::SourceRange(begin, end));
 	}
 
-	clang::SourceLocation FindRBrace(const clang::DeclContext *decl_ctx){
+	clang::SourceLocation FindRBrace(const clang::Decl *decl){
+		const auto decl_ctx = decl->getDeclContext();
 		if(clang::isa<clang::NamespaceDecl>(decl_ctx)){
 			const auto namespace_decl =
 				clang::dyn_cast<clang::NamespaceDecl>(decl_ctx);
@@ -442,24 +1363,68 @@ private:
 				clang::dyn_cast<clang::RecordDecl>(decl_ctx);
 			return record_decl->getBraceRange().getEnd();
 		}else{
-			const auto main_file_id = m_source_manager->getMainFileID();
-			return m_source_manager->getLocForEndOfFile(main_file_id);
+			const auto file_id = FileOf(decl->getBeginLoc());
+			return EndOfFile(file_id);
 		}
 		return clang::SourceLocation();
 	}
 
-	clang::SourceLocation DeclEnd(const clang::Decl *decl){
-		const auto next_explicit_decl = [](const clang::Decl *decl){
+	// 文脈内の宣言を一度だけ走査し、それぞれの次の明示的な宣言を表に記録する
+	void FillDeclLines(const clang::DeclContext *context){
+		auto &state = Marking();
+		if(!state.filled_contexts.insert(context).second){ return; }
+		std::unordered_map<unsigned int, std::vector<const clang::Decl *>> pending;
+		for(const auto child : context->decls()){
+			const auto file_id = FileOf(child->getBeginLoc()).getHashValue();
+			auto &waiting = pending[file_id];
+			if(!child->isImplicit()){
+				for(const auto prev : waiting){ state.decl_lines[prev].next = child; }
+				waiting.clear();
+			}
+			state.decl_lines[child] = DeclLines{ nullptr, clang::SourceLocation() };
+			waiting.push_back(child);
+		}
+	}
+
+	const clang::Decl *NextExplicitDecl(const clang::Decl *decl){
+		FillDeclLines(decl->getLexicalDeclContext());
+		const auto &decl_lines = Marking().decl_lines;
+		const auto it = decl_lines.find(decl);
+		if(it != decl_lines.end()){ return it->second.next; }
+		// 文脈の宣言列に含まれない (暗黙のインスタンス化など)
+		const auto file_id = FileOf(decl->getBeginLoc());
+		decl = decl->getNextDeclInContext();
+		while(decl && (
+			decl->isImplicit() || FileOf(decl->getBeginLoc()) != file_id))
+		{
 			decl = decl->getNextDeclInContext();
-			while(decl && decl->isImplicit()){
-				decl = decl->getNextDeclInContext();
+		}
+		return decl;
+	}
+
+	clang::SourceLocation DeclEnd(const clang::Decl *decl){
+		auto &decl_lines = Marking().decl_lines;
+		const auto it = decl_lines.find(decl);
+		if(it != decl_lines.end() && it->second.end.isValid()){
+			return it->second.end;
+		}
+		const auto end = ComputeDeclEnd(decl);
+		// 文脈の宣言列に含まれない宣言は表に加えない
+		const auto entry = decl_lines.find(decl);
+		if(entry != decl_lines.end()){ entry->second.end = end; }
+		return end;
+	}
+
+	clang::SourceLocation ComputeDeclEnd(const clang::Decl *decl){
+		// 同じファイル内で次に現れる明示的な定義
+		const auto next = NextExplicitDecl(decl);
+		if(next){
+			// 宣言指定子を共有する宣言 (int a, b; や struct S { } s; など) はまとめて扱う
+			if(Offset(next->getBeginLoc()) <= Offset(decl->getEndLoc())){
+				return DeclEnd(next);
 			}
-			return decl;
-		};
-		auto next = next_explicit_decl(decl);
-		if(next){ return PreviousLine(next->getBeginLoc()); }
-		const auto main_file_id = m_source_manager->getMainFileID();
-		const auto eof = m_source_manager->getLocForEndOfFile(main_file_id);
+			return next->getBeginLoc();
+		}
 		if(clang::isa<clang::ClassTemplateSpecializationDecl>(decl)){
 			const auto cts_decl =
 				clang::dyn_cast<clang::ClassTemplateSpecializationDecl>(decl);
@@ -494,41 +1459,40 @@ private:
 				return DeclEnd(func_decl->getPrimaryTemplate());
 			}
 		}
-		const auto rbrace = FindRBrace(decl->getDeclContext());
-		const auto rbrace_line = m_source_manager->getPresumedLineNumber(rbrace);
-		const auto decl_end = decl->getSourceRange().getEnd();
-		const auto decl_end_line = m_source_manager->getPresumedLineNumber(decl_end);
-		if(rbrace_line > decl_end_line){
-			return PreviousLine(rbrace);
+		// 文脈の最後の宣言は閉じ括弧 (ファイルの終端) の直前まで
+		const auto rbrace = FindRBrace(decl);
+		const auto decl_end = EndOfToken(decl->getSourceRange().getEnd());
+		if(rbrace.isValid() && FileOf(rbrace) == FileOf(decl_end)
+			&& Offset(rbrace) >= Offset(decl_end))
+		{
+			return rbrace;
 		}else{
 			return decl_end;
 		}
 	}
 
+	// 頭部の終端 (最初の子の直前、子がなければ閉じ括弧)
 	clang::SourceLocation EndOfHead(const clang::Decl *decl){
 		auto loc = decl->getEndLoc();
 		if(clang::isa<clang::DeclContext>(decl)){
 			const auto context = clang::dyn_cast<clang::DeclContext>(decl);
+			const auto file_id = FileOf(decl->getBeginLoc());
+			auto head_end = Offset(loc);
 			for(const auto child : context->decls()){
 				if(child->isImplicit()){ continue; }
-				const auto a =
-					m_source_manager->getPresumedLineNumber(loc);
-				const auto b =
-					m_source_manager->getPresumedLineNumber(child->getBeginLoc());
-				if(b < a){ loc = child->getBeginLoc(); }
+				if(FileOf(child->getBeginLoc()) != file_id){ continue; }
+				const auto offset = Offset(child->getBeginLoc());
+				if(offset < head_end){
+					loc = child->getBeginLoc();
+					head_end = offset;
+				}
 			}
-			const auto a =
-				m_source_manager->getPresumedLineNumber(decl->getBeginLoc());
-			const auto b = m_source_manager->getPresumedLineNumber(loc);
-			if(b > a){ loc = PreviousLine(loc); }
 		}
 		return loc;
 	}
 
 	bool MarkRecursive(const clang::Decl *decl, int depth){
-		if(m_traversed_decls.find(decl) == m_traversed_decls.end()){
-			return false;
-		}
+		if(!m_traversed_decls.contains(decl)){ return false; }
 #ifdef DEBUG_DUMP_AST
 		std::cerr << std::string(depth * 2, ' ')
 		          << "M: " << decl->getDeclKindName();
@@ -569,6 +1533,37 @@ private:
 		return result;
 	}
 
+	//------------------------------------------------------------------------
+	// Required headers
+	//------------------------------------------------------------------------
+	void CollectRequiredHeaders(){
+		auto &required = *m_options.required_headers;
+		// 索引の閉包はシステムヘッダの宣言を含まない
+		if(m_options.index){ required.complete = false; }
+		std::unordered_map<unsigned int, std::string> headers;
+		m_traversed_decls.for_each([&](const clang::Decl *decl){
+			// 名前空間はどのヘッダでも開き直される
+			if(clang::isa<clang::NamespaceDecl>(decl)){ return; }
+			if(clang::isa<clang::LinkageSpecDecl>(decl)){ return; }
+			// -I で見つかる角括弧のヘッダはシステムヘッダではないので、
+			// ユーザの宣言も出どころを調べる
+			const auto loc = decl->getLocation();
+			if(loc.isInvalid()){ return; }
+			const auto file_id = FileOf(loc).getHashValue();
+			auto it = headers.find(file_id);
+			if(it == headers.end()){
+				std::string name;
+				if(!top_level_header(
+					*m_source_manager, *m_included_names, loc, name))
+				{
+					required.complete = false;
+				}
+				it = headers.emplace(file_id, std::move(name)).first;
+			}
+			if(!it->second.empty()){ required.names.insert(it->second); }
+		});
+	}
+
 	bool MarkDetail(const clang::AccessSpecDecl *decl, int){
 		MarkRange(decl->getBeginLoc(), DeclEnd(decl));
 		return true;
@@ -613,10 +1608,7 @@ private:
 			result |= MarkRecursive(spec, depth);
 		}
 		if(result){
-			auto template_tail = decl->getTemplatedDecl()->getBeginLoc();
-			const auto a = m_source_manager->getPresumedLineNumber(decl->getBeginLoc());
-			const auto b = m_source_manager->getPresumedLineNumber(template_tail);
-			if(b > a){ template_tail = PreviousLine(template_tail); }
+			const auto template_tail = decl->getTemplatedDecl()->getBeginLoc();
 			MarkRange(clang::SourceRange(decl->getBeginLoc(), template_tail));
 		}
 		return result;
@@ -642,10 +1634,7 @@ private:
 			result |= MarkRecursive(spec, depth);
 		}
 		if(result){
-			auto template_tail = decl->getTemplatedDecl()->getBeginLoc();
-			const auto a = m_source_manager->getPresumedLineNumber(decl->getBeginLoc());
-			const auto b = m_source_manager->getPresumedLineNumber(template_tail);
-			if(b > a){ template_tail = PreviousLine(template_tail); }
+			const auto template_tail = decl->getTemplatedDecl()->getBeginLoc();
 			MarkRange(clang::SourceRange(decl->getBeginLoc(), template_tail));
 		}
 		return result;
@@ -656,11 +1645,43 @@ private:
 	}
 
 public:
-	ASTConsumer(std::shared_ptr<ReachabilityMarker> marker)
+	ASTConsumer(
+		std::shared_ptr<ReachabilityMarkers> markers,
+		std::shared_ptr<const IncludedNames> included_names,
+		const ReachabilityAnalyzerOptions &options)
 		: clang::ASTConsumer()
-		, m_marker(std::move(marker))
+		, m_source_manager(nullptr)
+		, m_lang_options(nullptr)
+		, m_traversed_decls()
+		, m_traversed_stmts()
+		, m_traversed_types()
+		, m_worklist()
+		, m_pending_items(0)
+		, m_parallel(false)
+		, m_shared_mutex()
+		, m_locations()
+		, m_patterns()
+		, m_user_specializations()
+		, m_index_ids()
+		, m_indexed_decls()
+		, m_unit_states()
+		, m_index_files()
+		, m_markers(std::move(markers))
+		, m_included_names(std::move(included_names))
+		, m_marking()
+		, m_options(options)
 	{ }
 
+	// 関数本体のスキップは FrontendOptions::SkipFunctionBodies が有効な場合のみ問われる
+	virtual bool shouldSkipFunctionBody(clang::Decl *decl) override {
+		if(!m_options.skip_system_function_bodies){ return false; }
+		// テンプレートの本体はインスタンス化の際にユーザコードを参照し得る
+		const auto func_decl = decl->getAsFunction();
+		if(!func_decl || func_decl->isDependentContext()){ return false; }
+		const auto &sm = decl->getASTContext().getSourceManager();
+		return sm.isInSystemHeader(sm.getExpansionLoc(decl->getLocation()));
+	}
+
 	virtual void HandleTranslationUnit(clang::ASTContext &context) override {
 		const auto &sm = context.getSourceManager();
 		const auto tu = context.getTranslationUnitDecl();
@@ -668,7 +1689,22 @@ public:
 		tu->dump();
 #endif
 		m_source_manager = &sm;
+		m_lang_options = &context.getLangOpts();
 		reset();
+		if(m_options.build_index){
+			BuildIndex(context);
+			return;
+		}
+		PrepareIndex(tu);
+		unsigned int jobs = m_options.jobs;
+#ifdef DEBUG_DUMP_AST
+		jobs = 1;
+#endif
+		// 外部 AST (PCH) からの遅延読み込みはスレッド安全でない
+		if(context.getExternalSource()){ jobs = 1; }
+		m_traversed_decls.set_concurrency(jobs);
+		m_traversed_stmts.set_concurrency(jobs);
+		m_traversed_types.set_concurrency(jobs);
 		for(const auto decl : tu->decls()){
 			if(clang::isa<clang::VarDecl>(decl)){
 				Traverse(decl, 0);
@@ -684,35 +1720,234 @@ public:
 				}
 			}
 		}
-		for(const auto decl : tu->decls()){
-			MarkRecursive(decl, 0);
+		// 深い式でもスタックを消費しないよう、走査は作業リストで行う
+		if(jobs > 1){
+			PrepareParallel(tu);
+			DrainParallel(jobs);
+			MarkParallel(tu, jobs);
+		}else{
+			Drain();
+			for(const auto decl : tu->decls()){
+				MarkRecursive(decl, 0);
+			}
 		}
+		if(m_options.required_headers){ CollectRequiredHeaders(); }
+	}
+
+};
+
+thread_local ReachabilityAnalyzer::ASTConsumer::WorkQueue *
+	ReachabilityAnalyzer::ASTConsumer::s_current_queue = nullptr;
+thread_local ReachabilityAnalyzer::ASTConsumer::MarkingState *
+	ReachabilityAnalyzer::ASTConsumer::s_current_marking = nullptr;
+
+
+// インクルード指令の名前を、取り込まれたファイルの FileID に結び付ける
+class InclusionRecorder : public clang::PPCallbacks {
+
+private:
+	const clang::SourceManager &m_source_manager;
+	std::shared_ptr<IncludedNames> m_names;
+	// 指令はファイルに入る前に通知される
+	bool m_pending;
+	IncludedName m_pending_name;
+
+public:
+	InclusionRecorder(
+		const clang::SourceManager &source_manager,
+		std::shared_ptr<IncludedNames> names)
+		: clang::PPCallbacks()
+		, m_source_manager(source_manager)
+		, m_names(std::move(names))
+		, m_pending(false)
+		, m_pending_name()
+	{ }
+
+	virtual void InclusionDirective(
+		clang::SourceLocation,
+		const clang::Token &,
+		clang::StringRef filename,
+		bool is_angled,
+		clang::CharSourceRange,
+		const clang::FileEntry *,
+		clang::StringRef,
+		clang::StringRef,
+		const clang::Module *,
+		clang::SrcMgr::CharacteristicKind) override
+	{
+		m_pending = true;
+		m_pending_name = IncludedName{ filename.str(), is_angled };
+	}
+
+	virtual void FileChanged(
+		clang::SourceLocation loc,
+		FileChangeReason reason,
+		clang::SrcMgr::CharacteristicKind,
+		clang::FileID) override
+	{
+		if(reason == EnterFile && m_pending){
+			const auto file_id = m_source_manager.getFileID(loc);
+			(*m_names)[file_id.getHashValue()] = m_pending_name;
+		}
+		m_pending = false;
+	}
+
+	virtual void FileSkipped(
+		const clang::FileEntry &,
+		const clang::Token &,
+		clang::SrcMgr::CharacteristicKind) override
+	{
+		m_pending = false;
+	}
+
+};
+
+
+// 展開されるコードが使うマクロの出どころを記録する
+class MacroOriginCollector : public clang::PPCallbacks {
+
+private:
+	// 追跡できたか、および持ち上げられるヘッダ
+	using Origin = std::pair<bool, std::string>;
+
+	const clang::SourceManager &m_source_manager;
+	std::shared_ptr<const IncludedNames> m_names;
+	std::shared_ptr<RequiredHeaders> m_required;
+	// FileID のハッシュ値 -> そのファイルの出どころ
+	std::unordered_map<unsigned int, Origin> m_origins;
+
+	const Origin &OriginOf(const clang::SourceLocation &loc){
+		const auto file_id = m_source_manager.getFileID(
+			m_source_manager.getExpansionLoc(loc)).getHashValue();
+		auto it = m_origins.find(file_id);
+		if(it == m_origins.end()){
+			std::string name;
+			const bool traced =
+				top_level_header(m_source_manager, *m_names, loc, name);
+			it = m_origins.emplace(file_id, Origin(traced, std::move(name))).first;
+		}
+		return it->second;
+	}
+
+	void Require(
+		const clang::SourceLocation &use_loc,
+		const clang::MacroDefinition &definition)
+	{
+		const auto info = definition.getMacroInfo();
+		if(!info){ return; }
+		// システムヘッダ内での使用はそのヘッダが面倒を見る
+		if(m_source_manager.isInSystemHeader(
+			m_source_manager.getExpansionLoc(use_loc)))
+		{
+			return;
+		}
+		// 展開されないヘッダでの使用も同様
+		const auto &use = OriginOf(use_loc);
+		if(!use.first){
+			m_required->complete = false;
+			return;
+		}
+		if(!use.second.empty()){ return; }
+		const auto def_loc = info->getDefinitionLoc();
+		if(def_loc.isInvalid()){ return; }
+		const auto &def = OriginOf(def_loc);
+		if(!def.first){
+			m_required->complete = false;
+		}else if(!def.second.empty()){
+			m_required->names.insert(def.second);
+		}
+	}
+
+public:
+	MacroOriginCollector(
+		const clang::SourceManager &source_manager,
+		std::shared_ptr<const IncludedNames> names,
+		std::shared_ptr<RequiredHeaders> required)
+		: clang::PPCallbacks()
+		, m_source_manager(source_manager)
+		, m_names(std::move(names))
+		, m_required(std::move(required))
+		, m_origins()
+	{ }
+
+	virtual void MacroExpands(
+		const clang::Token &name,
+		const clang::MacroDefinition &definition,
+		clang::SourceRange,
+		const clang::MacroArgs *) override
+	{
+		Require(name.getLocation(), definition);
+	}
+
+	virtual void Defined(
+		const clang::Token &name,
+		const clang::MacroDefinition &definition,
+		clang::SourceRange) override
+	{
+		Require(name.getLocation(), definition);
+	}
+
+	virtual void Ifdef(
+		clang::SourceLocation,
+		const clang::Token &name,
+		const clang::MacroDefinition &definition) override
+	{
+		Require(name.getLocation(), definition);
+	}
+
+	virtual void Ifndef(
+		clang::SourceLocation,
+		const clang::Token &name,
+		const clang::MacroDefinition &definition) override
+	{
+		Require(name.getLocation(), definition);
 	}
 
 };
 
 
 ReachabilityAnalyzer::ReachabilityAnalyzer(
-	std::shared_ptr<ReachabilityMarker> marker)
+	std::shared_ptr<ReachabilityMarkers> markers,
+	const ReachabilityAnalyzerOptions &options)
 	: clang::ASTFrontendAction()
-	, m_marker(std::move(marker))
+	, m_markers(std::move(markers))
+	, m_options(options)
 { }
 
+bool ReachabilityAnalyzer::BeginInvocation(clang::CompilerInstance &ci){
+	if(m_options.skip_system_function_bodies){
+		// Which bodies are skipped is decided by the consumer
+		ci.getFrontendOpts().SkipFunctionBodies = true;
+	}
+	return clang::ASTFrontendAction::BeginInvocation(ci);
+}
+
 std::unique_ptr<clang::ASTConsumer> ReachabilityAnalyzer::CreateASTConsumer(
 	clang::CompilerInstance &ci,
 	llvm::StringRef in_file)
 {
-	return std::make_unique<ASTConsumer>(m_marker);
+	auto included_names = std::make_shared<IncludedNames>();
+	if(m_options.required_headers){
+		auto &pp = ci.getPreprocessor();
+		pp.addPPCallbacks(std::make_unique<InclusionRecorder>(
+			ci.getSourceManager(), included_names));
+		pp.addPPCallbacks(std::make_unique<MacroOriginCollector>(
+			ci.getSourceManager(), included_names, m_options.required_headers));
+	}
+	return std::make_unique<ASTConsumer>(
+		m_markers, std::move(included_names), m_options);
 }
 
 
 ReachabilityAnalyzerFactory::ReachabilityAnalyzerFactory(
-	std::shared_ptr<ReachabilityMarker> marker)
+	std::shared_ptr<ReachabilityMarkers> markers,
+	const ReachabilityAnalyzerOptions &options)
 	: clang::tooling::FrontendActionFactory()
-	, m_marker(std::move(marker))
+	, m_markers(std::move(markers))
+	, m_options(options)
 { }
 
 std::unique_ptr<clang::FrontendAction> ReachabilityAnalyzerFactory::create(){
-	return std::make_unique<ReachabilityAnalyzer>(m_marker);
+	return std::make_unique<ReachabilityAnalyzer>(m_markers, m_options);
 }
 
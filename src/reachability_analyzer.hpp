@@ -2,22 +2,53 @@
 #define CPP_SIMPLIFIER_REACHABILITY_ANALYZER_HPP
 
 #include <memory>
+#include <string>
+#include <unordered_set>
 #include <clang/AST/ASTConsumer.h>
 #include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Tooling/Tooling.h>
 #include "reachability_marker.hpp"
 
+struct ReachabilityIndex;
+
+// Angled inclusions the reachable code depends on, spelled as written
+struct RequiredHeaders {
+	std::unordered_set<std::string> names;
+	// False when some dependency could not be traced back to an inclusion
+	bool complete = true;
+};
+
+struct ReachabilityAnalyzerOptions {
+	// Leave bodies of non-template functions in system headers unparsed.
+	// They cannot refer to user code, so the markers are unaffected.
+	bool skip_system_function_bodies = false;
+	// Threads traversing the AST from the roots. Markers are identical for
+	// any value.
+	unsigned int jobs = 1;
+	// Closures of library declarations computed ahead of time
+	std::shared_ptr<ReachabilityIndex> index;
+	// Add the closures of the parsed header to index instead of marking
+	bool build_index = false;
+	// Filled with the hoisted headers that reachable declarations and
+	// macros used by unrolled code come from when set
+	std::shared_ptr<RequiredHeaders> required_headers;
+};
+
 class ReachabilityAnalyzer : public clang::ASTFrontendAction {
 
 private:
-	std::shared_ptr<ReachabilityMarker> m_marker;
+	std::shared_ptr<ReachabilityMarkers> m_markers;
+	ReachabilityAnalyzerOptions m_options;
 
 public:
 	class ASTConsumer;
 
 	ReachabilityAnalyzer(
-		std::shared_ptr<ReachabilityMarker> marker);
+		std::shared_ptr<ReachabilityMarkers> markers,
+		const ReachabilityAnalyzerOptions &options);
+
+	virtual bool BeginInvocation(clang::CompilerInstance &ci) override;
 
 	virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
 		clang::CompilerInstance &ci,
@@ -30,11 +61,13 @@ class ReachabilityAnalyzerFactory
 {
 
 private:
-	std::shared_ptr<ReachabilityMarker> m_marker;
+	std::shared_ptr<ReachabilityMarkers> m_markers;
+	ReachabilityAnalyzerOptions m_options;
 
 public:
 	ReachabilityAnalyzerFactory(
-		std::shared_ptr<ReachabilityMarker> marker);
+		std::shared_ptr<ReachabilityMarkers> markers,
+		const ReachabilityAnalyzerOptions &options);
 
 	virtual std::unique_ptr<clang::FrontendAction> create() override;
 
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+#include <clang/Basic/Diagnostic.h>
+#include "reachability_index.hpp"
+#include "reachability_analyzer.hpp"
+#include "compilation_session.hpp"
+
+static const char *const index_signature = "cpp-simplifier-index 1";
+
+unsigned int ReachabilityIndex::add_file(
+	const std::string &path,
+	const std::string &hash)
+{
+	const auto it = file_ids.find(path);
+	if(it != file_ids.end()){ return it->second; }
+	const auto id = static_cast<unsigned int>(files.size());
+	files.push_back(File{ path, hash });
+	file_ids.emplace(path, id);
+	return id;
+}
+
+unsigned int ReachabilityIndex::add_declaration(const std::string &key){
+	const auto it = declaration_ids.find(key);
+	if(it != declaration_ids.end()){ return it->second; }
+	const auto id = static_cast<unsigned int>(declarations.size());
+	declarations.push_back(Declaration{ key, -1, llvm::BitVector() });
+	declaration_ids.emplace(key, id);
+	return id;
+}
+
+std::string ReachabilityIndex::normalize_path(llvm::StringRef path){
+	llvm::SmallString<256> result(path);
+	llvm::sys::fs::make_absolute(result);
+	llvm::sys::path::remove_dots(result, true);
+	return result.str().str();
+}
+
+std::string ReachabilityIndex::content_hash(llvm::StringRef content){
+	llvm::MD5 hash;
+	hash.update(content);
+	llvm::MD5::MD5Result result;
+	hash.final(result);
+	return result.digest().str().str();
+}
+
+std::string ReachabilityIndex::declaration_key(
+	unsigned int file,
+	unsigned int offset,
+	llvm::StringRef usr)
+{
+	return std::to_string(file) + ":" + std::to_string(offset) + ":" + usr.str();
+}
+
+bool ReachabilityIndex::contains(llvm::StringRef normalized_path) const {
+	if(!normalized_path.startswith(directory)){ return false; }
+	const auto rest = normalized_path.drop_front(directory.size());
+	return !rest.empty() && llvm::sys::path::is_separator(rest.front());
+}
+
+// Bit vectors are written as hexadecimal digits, four bits per digit
+static std::string encode_bits(const llvm::BitVector &bits){
+	std::string result((bits.size() + 3) / 4, '0');
+	for(const auto i : bits.set_bits()){
+		auto &c = result[i / 4];
+		const int digit = (c <= '9' ? c - '0' : c - 'a' + 10) | (1 << (i % 4));
+		c = "0123456789abcdef"[digit];
+	}
+	return result;
+}
+
+static bool decode_bits(
+	const std::string &text,
+	std::size_t size,
+	llvm::BitVector &bits)
+{
+	if(text.size() != (size + 3) / 4){ return false; }
+	bits.clear();
+	bits.resize(size);
+	for(std::size_t i = 0; i < text.size(); ++i){
+		const char c = text[i];
+		int digit = 0;
+		if('0' <= c && c <= '9'){
+			digit = c - '0';
+		}else if('a' <= c && c <= 'f'){
+			digit = c - 'a' + 10;
+		}else{
+			return false;
+		}
+		for(int j = 0; j < 4; ++j){
+			if(!(digit & (1 << j))){ continue; }
+			if(i * 4 + j >= size){ return false; }
+			bits.set(i * 4 + j);
+		}
+	}
+	return true;
+}
+
+static bool read_count(std::istream &is, std::size_t &count){
+	std::string line;
+	if(!std::getline(is, line)){ return false; }
+	std::istringstream iss(line);
+	return static_cast<bool>(iss >> count);
+}
+
+bool ReachabilityIndex::load(const std::string &path){
+	std::ifstream ifs(path.c_str());
+	if(!ifs){ return false; }
+	std::string line;
+	if(!std::getline(ifs, line) || line != index_signature){ return false; }
+	if(!std::getline(ifs, directory)){ return false; }
+
+	std::size_t count = 0;
+	if(!read_count(ifs, count)){ return false; }
+	for(std::size_t i = 0; i < count; ++i){
+		// <hash> <path>
+		if(!std::getline(ifs, line)){ return false; }
+		const auto space = line.find(' ');
+		if(space == std::string::npos){ return false; }
+		add_file(line.substr(space + 1), line.substr(0, space));
+	}
+
+	if(!read_count(ifs, count)){ return false; }
+	for(std::size_t i = 0; i < count; ++i){
+		// <file>...
+		if(!std::getline(ifs, line)){ return false; }
+		std::istringstream iss(line);
+		Unit unit;
+		unsigned int file = 0;
+		while(iss >> file){
+			if(file >= files.size()){ return false; }
+			unit.files.push_back(file);
+		}
+		units.push_back(std::move(unit));
+	}
+
+	if(!read_count(ifs, count)){ return false; }
+	for(std::size_t i = 0; i < count; ++i){
+		// <unit> <closure> <key>, or - - <key> without a closure
+		if(!std::getline(ifs, line)){ return false; }
+		std::istringstream iss(line);
+		std::string unit, closure, key;
+		if(!(iss >> unit >> closure)){ return false; }
+		std::getline(iss >> std::ws, key);
+		add_declaration(key);
+		if(unit == "-"){ continue; }
+		auto &decl = declarations.back();
+		std::istringstream unit_iss(unit);
+		if(!(unit_iss >> decl.unit)){ return false; }
+		if(decl.unit < 0 || static_cast<std::size_t>(decl.unit) >= units.size()){
+			return false;
+		}
+		if(!decode_bits(closure, count, decl.closure)){ return false; }
+	}
+	return true;
+}
+
+bool ReachabilityIndex::save(const std::string &path) const {
+	std::ofstream ofs(path.c_str());
+	ofs << index_signature << "\n";
+	ofs << directory << "\n";
+	ofs << files.size() << "\n";
+	for(const auto &file : files){
+		ofs << file.hash << " " << file.path << "\n";
+	}
+	ofs << units.size() << "\n";
+	for(const auto &unit : units){
+		for(std::size_t i = 0; i < unit.files.size(); ++i){
+			ofs << (i == 0 ? "" : " ") << unit.files[i];
+		}
+		ofs << "\n";
+	}
+	ofs << declarations.size() << "\n";
+	for(const auto &decl : declarations){
+		if(decl.unit < 0){
+			ofs << "- - " << decl.key << "\n";
+			continue;
+		}
+		// Closures were computed before later declarations were added
+		auto closure = decl.closure;
+		closure.resize(declarations.size());
+		ofs << decl.unit << " " << encode_bits(closure) << " "
+		    << decl.key << "\n";
+	}
+	return static_cast<bool>(ofs);
+}
+
+
+static bool is_header(llvm::StringRef path){
+	const auto extension = llvm::sys::path::extension(path);
+	return extension == ".h" || extension == ".hh" ||
+	       extension == ".hpp" || extension == ".hxx";
+}
+
+std::shared_ptr<ReachabilityIndex> build_reachability_index(
+	CompilationSession &session,
+	const std::string &directory)
+{
+	auto index = std::make_shared<ReachabilityIndex>();
+	index->directory = ReachabilityIndex::normalize_path(directory);
+
+	std::vector<std::string> headers;
+	std::error_code ec;
+	for(llvm::sys::fs::recursive_directory_iterator it(index->directory, ec), end;
+	    it != end && !ec; it.increment(ec))
+	{
+		if(is_header(it->path())){ headers.push_back(it->path()); }
+	}
+	if(ec){
+		std::cerr << index->directory << ": " << ec.message() << std::endl;
+		return nullptr;
+	}
+	std::sort(headers.begin(), headers.end());
+
+	ReachabilityAnalyzerOptions options;
+	options.index = index;
+	options.build_index = true;
+	for(const auto &header : headers){
+		// Headers that need a context to compile are left out
+		clang::IgnoringDiagConsumer diag_consumer;
+		auto markers = std::make_shared<ReachabilityMarkers>();
+		ReachabilityAnalyzerFactory factory(markers, options);
+		if(!session.run(header, factory, {}, &diag_consumer)){
+			std::cerr << "Skipped " << header
+			          << ": it does not compile on its own." << std::endl;
+		}
+	}
+	return index;
+}
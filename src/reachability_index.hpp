@@ -0,0 +1,69 @@
+#ifndef CPP_SIMPLIFIER_REACHABILITY_INDEX_HPP
+#define CPP_SIMPLIFIER_REACHABILITY_INDEX_HPP
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/StringRef.h>
+
+class CompilationSession;
+
+// Reachability closures of the declarations in a header library, computed
+// once by `cpp-simplifier index`. Every header is parsed on its own, and
+// for each declaration it defines the index stores the set of library
+// declarations that the analyzer traverses from it. A declaration is
+// keyed by its file, its offset and its USR, so redeclarations are told
+// apart. Closures are used only while every file read by the header's
+// parse still has the recorded contents.
+struct ReachabilityIndex {
+
+	struct File {
+		std::string path;
+		std::string hash;
+	};
+
+	// Header parsed as a translation unit, with the library files it read
+	struct Unit {
+		std::vector<unsigned int> files;
+	};
+
+	struct Declaration {
+		std::string key;
+		// Unit the closure was computed in, or -1 if it was not
+		int unit;
+		// Bit i is set when declarations[i] is reached
+		llvm::BitVector closure;
+	};
+
+	std::string directory;
+	std::vector<File> files;
+	std::vector<Unit> units;
+	std::vector<Declaration> declarations;
+
+	std::unordered_map<std::string, unsigned int> file_ids;
+	std::unordered_map<std::string, unsigned int> declaration_ids;
+
+	unsigned int add_file(const std::string &path, const std::string &hash);
+	unsigned int add_declaration(const std::string &key);
+
+	// Absolute path without . and .. components, as stored in the index
+	static std::string normalize_path(llvm::StringRef path);
+	static std::string content_hash(llvm::StringRef content);
+	static std::string declaration_key(
+		unsigned int file, unsigned int offset, llvm::StringRef usr);
+
+	bool contains(llvm::StringRef normalized_path) const;
+
+	bool load(const std::string &path);
+	bool save(const std::string &path) const;
+
+};
+
+// Parses every header under directory and computes the closures.
+std::shared_ptr<ReachabilityIndex> build_reachability_index(
+	CompilationSession &session,
+	const std::string &directory);
+
+#endif
@@ -1,37 +1,77 @@
 #ifndef CPP_SIMPLIFIER_REACHABILITY_MARKER_HPP
 #define CPP_SIMPLIFIER_REACHABILITY_MARKER_HPP
 
-#include <vector>
+#include <iterator>
+#include <map>
+#include <string>
+#include <unordered_map>
 
+// Set of marked byte offsets of a file, kept as disjoint and coalesced
+// [begin, end) ranges
 class ReachabilityMarker {
 
 private:
-	std::vector<bool> m_marker;
+	// begin -> end
+	std::map<unsigned int, unsigned int> m_ranges;
 
 public:
+	using const_iterator = std::map<unsigned int, unsigned int>::const_iterator;
+
 	ReachabilityMarker()
-		: m_marker()
+		: m_ranges()
 	{ }
 
-	void mark(unsigned int line){
-		while(m_marker.size() <= line){
-			m_marker.push_back(false);
-		}
-		m_marker[line] = true;
+	void mark(unsigned int offset){
+		mark(offset, offset + 1);
 	}
 
-	void unmark(unsigned int line){
-		if((*this)(line)){
-			m_marker[line] = false;
+	// Marks offsets in [begin, end)
+	void mark(unsigned int begin, unsigned int end){
+		if(begin >= end){ return; }
+		// Ranges overlapping or adjacent to [begin, end) are merged
+		auto first = m_ranges.upper_bound(begin);
+		if(first != m_ranges.begin() && std::prev(first)->second >= begin){
+			--first;
+		}
+		auto last = first;
+		while(last != m_ranges.end() && last->first <= end){
+			if(last->first < begin){ begin = last->first; }
+			if(last->second > end){ end = last->second; }
+			++last;
 		}
+		const auto hint = m_ranges.erase(first, last);
+		m_ranges.emplace_hint(hint, begin, end);
+	}
+
+	void unmark(unsigned int offset){
+		const auto it = lower_bound(offset);
+		if(it == m_ranges.end() || it->first > offset){ return; }
+		const auto begin = it->first, end = it->second;
+		const auto hint = m_ranges.erase(it);
+		if(offset + 1 < end){ m_ranges.emplace_hint(hint, offset + 1, end); }
+		if(begin < offset){ m_ranges.emplace(begin, offset); }
 	}
 
-	bool operator()(unsigned int line) const {
-		if(line >= m_marker.size()){ return false; }
-		return m_marker[line];
+	bool operator()(unsigned int offset) const {
+		const auto it = lower_bound(offset);
+		return it != m_ranges.end() && it->first <= offset;
 	}
 
+	// The first range that ends after offset
+	const_iterator lower_bound(unsigned int offset) const {
+		auto it = m_ranges.upper_bound(offset);
+		if(it != m_ranges.begin() && std::prev(it)->second > offset){ --it; }
+		return it;
+	}
+
+	const_iterator begin() const { return m_ranges.begin(); }
+	const_iterator end() const { return m_ranges.end(); }
+
 };
 
+// Markers for each user file, keyed by the name of its FileEntry
+using ReachabilityMarkers =
+	std::unordered_map<std::string, ReachabilityMarker>;
+
 #endif
 
@@ -1,42 +1,216 @@
-#include <sstream>
+#include <algorithm>
 #include <memory>
+#include <unordered_set>
+#include <utility>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/raw_ostream.h>
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Tooling/Tooling.h>
-#include <clang/Tooling/CompilationDatabase.h>
-#include <clang/Tooling/ArgumentsAdjusters.h>
 #include "simplifier.hpp"
+#include "compilation_session.hpp"
 #include "reachability_analyzer.hpp"
 
-std::string simplify(
-	const std::string &input_source,
-	const std::string &input_filename,
-	const std::vector<std::string> &clang_options)
+std::shared_ptr<ReachabilityMarkers> analyze_reachability(
+	CompilationSession &session,
+	const std::vector<std::string> &extra_options,
+	const ReachabilityAnalyzerOptions &options)
 {
-	namespace tooling = clang::tooling;
-	tooling::FixedCompilationDatabase compilations(".", clang_options);
-	tooling::ClangTool tool(
-		compilations, llvm::ArrayRef<std::string>(input_filename));
-	tool.mapVirtualFile(input_filename, input_source);
+	auto markers = std::make_shared<ReachabilityMarkers>();
+	ReachabilityAnalyzerFactory analyzer_factory(markers, options);
+	if(!session.run(analyzer_factory, extra_options)){
+		llvm::errs() << "Error while processing "
+		             << session.input_filename() << ".\n";
+		return nullptr;
+	}
+	return markers;
+}
+
+using MarkedRanges = llvm::SmallVector<std::pair<unsigned int, unsigned int>, 4>;
+
+// Walks the marked ranges of a file along with lines queried in order
+class MarkerCursor {
+
+private:
+	const ReachabilityMarker *m_marker;
+	ReachabilityMarker::const_iterator m_range;
+	unsigned int m_offset;
+
+public:
+	explicit MarkerCursor(const ReachabilityMarker *marker)
+		: m_marker(marker)
+		, m_range()
+		, m_offset(0)
+	{
+		if(m_marker){ m_range = m_marker->begin(); }
+	}
+
+	// Marked parts of [begin, end), relative to begin
+	MarkedRanges operator()(unsigned int begin, unsigned int end){
+		MarkedRanges ranges;
+		if(!m_marker){ return ranges; }
+		// A file unrolled more than once is queried from its beginning again
+		if(begin < m_offset){ m_range = m_marker->lower_bound(begin); }
+		m_offset = begin;
+		while(m_range != m_marker->end() && m_range->second <= begin){ ++m_range; }
+		for(auto it = m_range; it != m_marker->end() && it->first < end; ++it){
+			ranges.emplace_back(
+				std::max(it->first, begin) - begin,
+				std::min(it->second, end) - begin);
+		}
+		return ranges;
+	}
+
+};
+
+static bool is_standard_header(const std::string &name){
+	static const std::unordered_set<std::string> headers = {
+		// C++ library
+		"algorithm", "any", "array", "atomic", "bitset", "chrono", "codecvt",
+		"complex", "condition_variable", "deque", "exception", "forward_list",
+		"fstream", "functional", "future", "initializer_list", "iomanip",
+		"ios", "iosfwd", "iostream", "istream", "iterator", "limits", "list",
+		"locale", "map", "memory", "mutex", "new", "numeric", "optional",
+		"ostream", "queue", "random", "ratio", "regex", "scoped_allocator",
+		"set", "shared_mutex", "sstream", "stack", "stdexcept", "streambuf",
+		"string", "string_view", "system_error", "thread", "tuple",
+		"type_traits", "typeindex", "typeinfo", "unordered_map",
+		"unordered_set", "utility", "valarray", "variant", "vector",
+		// C library
+		"cassert", "cctype", "cerrno", "cfenv", "cfloat", "cinttypes",
+		"climits", "clocale", "cmath", "csetjmp", "csignal", "cstdarg",
+		"cstddef", "cstdint", "cstdio", "cstdlib", "cstring", "ctime",
+		"cuchar", "cwchar", "cwctype",
+		"bits/stdc++.h"
+	};
+	return headers.count(name) > 0;
+}
+
+static std::vector<std::string> select_inclusions(
+	const std::vector<std::string> &inclusions,
+	const InclusionOptions &options)
+{
+	const auto &required = options.required;
+	std::vector<std::string> result;
+	for(const auto &s : inclusions){
+		if(!required || !required->complete || required->names.count(s)){
+			result.push_back(s);
+		}
+	}
+	if(options.collapse_threshold == 0){ return result; }
+	const auto standard = static_cast<unsigned int>(std::count_if(
+		result.begin(), result.end(), is_standard_header));
+	if(standard <= options.collapse_threshold){ return result; }
+	result.erase(
+		std::remove_if(result.begin(), result.end(), is_standard_header),
+		result.end());
+	result.insert(result.begin(), "bits/stdc++.h");
+	return result;
+}
+
+static bool is_blank(llvm::StringRef text){
+	for(const char c : text){
+		if(!isspace(c)){ return false; }
+	}
+	return true;
+}
 
-	tool.appendArgumentsAdjuster(tooling::getClangSyntaxOnlyAdjuster());
-	auto marker = std::make_shared<ReachabilityMarker>();
-	ReachabilityAnalyzerFactory analyzer_factory(marker);
-	if(tool.run(&analyzer_factory) != 0){
-		throw std::runtime_error("compilation error");
+// Keeps every line when markers is null
+static SimplifiedSource simplify_lines(
+	const UnrolledSource &unrolled,
+	const ReachabilityMarkers *markers,
+	const InclusionOptions &inclusion_options)
+{
+	std::vector<MarkerCursor> file_markers;
+	for(const auto &source : unrolled.sources){
+		if(!markers){
+			file_markers.emplace_back(nullptr);
+			continue;
+		}
+		const auto it = markers->find(source.filename);
+		file_markers.emplace_back(it != markers->end() ? &it->second : nullptr);
 	}
 
-	std::istringstream iss(input_source);
-	std::ostringstream oss;
-	for(unsigned int i = 0; !iss.eof(); ++i){
-		std::string line;
-		if(std::getline(iss, line)){
-			unsigned int j = 0;
-			while(j < line.size() && isspace(line[j])){ ++j; }
-			if(line[j] == '#'){ marker->mark(i); }
-			if((*marker)(i)){ oss << line << std::endl; }
+	SimplifiedSource result;
+	for(const auto &s : select_inclusions(unrolled.angled_inclusions, inclusion_options)){
+		result.head += "#include <" + s + ">\n";
+	}
+	// Adjacent lines of a buffer are written as a single range
+	const auto append = [&result](llvm::StringRef piece){
+		auto &body = result.body;
+		if(!body.empty() && body.back().end() == piece.begin()){
+			body.back() = llvm::StringRef(
+				body.back().data(), body.back().size() + piece.size());
+		}else{
+			body.push_back(piece);
 		}
+	};
+	for(const auto &line : unrolled.lines){
+		const auto &source = unrolled.sources[line.file];
+		const auto text = source.line(line.line);
+		// The line break follows the line unless it is the last one
+		const bool has_break = (text.end() != source.text.end());
+		const auto whole_line = [&](){
+			append(llvm::StringRef(
+				text.data(), text.size() + (has_break ? 1 : 0)));
+			if(!has_break){ append("\n"); }
+		};
+		unsigned int j = 0;
+		while(j < text.size() && isspace(text[j])){ ++j; }
+		if(!markers || (j < text.size() && text[j] == '#')){
+			whole_line();
+			continue;
+		}
+		// Markers are in bytes, so a line may be kept in part
+		const unsigned int offset = text.data() - source.text.data();
+		const auto ranges = file_markers[line.file](
+			offset, offset + text.size() + (has_break ? 1 : 0));
+		if(ranges.empty()){ continue; }
+		if(ranges.front().first == 0 && ranges.front().second >= text.size()){
+			whole_line();
+			continue;
+		}
+		std::vector<bool> marked(text.size());
+		bool has_token = false;
+		for(const auto &range : ranges){
+			for(unsigned int k = range.first; k < range.second && k < text.size(); ++k){
+				marked[k] = true;
+				has_token |= !isspace(text[k]);
+			}
+		}
+		// A line with nothing but whitespace marked is dropped unless blank
+		if(!has_token && !is_blank(text)){ continue; }
+		unsigned int k = 0;
+		while(k < text.size()){
+			const unsigned int first = k;
+			const bool is_marked = marked[k];
+			while(k < text.size() && marked[k] == is_marked){ ++k; }
+			const auto run = text.slice(first, k);
+			if(is_marked || is_blank(run)){
+				append(run);
+				continue;
+			}
+			// Unmarked tokens are cut, leaving the indentation of the line
+			// and a space where two tokens would be joined
+			if(first == 0){
+				append(run.take_while([](char c){ return isspace(c) != 0; }));
+			}else if(k < text.size() && !isspace(text[first - 1]) && !isspace(text[k])){
+				append(" ");
+			}
+		}
+		append(has_break ? llvm::StringRef(text.end(), 1) : llvm::StringRef("\n"));
 	}
 
-	return oss.str();
+	return result;
 }
 
+SimplifiedSource simplify(
+	const UnrolledSource &unrolled,
+	const ReachabilityMarkers &markers,
+	const InclusionOptions &inclusion_options)
+{
+	return simplify_lines(unrolled, &markers, inclusion_options);
+}
+
+SimplifiedSource unpruned(const UnrolledSource &unrolled){
+	return simplify_lines(unrolled, nullptr, InclusionOptions());
+}
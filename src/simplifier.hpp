@@ -1,13 +1,47 @@
 #ifndef CPP_SIMPLIFIER_SIMPLIFIER_HPP
 #define CPP_SIMPLIFIER_SIMPLIFIER_HPP
 
+#include <memory>
 #include <string>
 #include <vector>
+#include <llvm/ADT/StringRef.h>
+#include "inclusion_unroller.hpp"
+#include "reachability_marker.hpp"
+#include "reachability_analyzer.hpp"
 
-std::string simplify(
-	const std::string &input_source,
-	const std::string &input_filename,
-	const std::vector<std::string> &clang_options);
+class CompilationSession;
 
-#endif
+// Parses the input with its own include structure and marks the lines of
+// user files that are reachable from main. Diagnostics are printed as
+// usual and nullptr is returned when the input does not compile.
+// extra_options are appended to the session's options for this pass only.
+std::shared_ptr<ReachabilityMarkers> analyze_reachability(
+	CompilationSession &session,
+	const std::vector<std::string> &extra_options,
+	const ReachabilityAnalyzerOptions &options);
+
+struct SimplifiedSource {
+	// Hoisted angled inclusions
+	std::string head;
+	// Kept text as ranges of the unrolled sources' buffers
+	std::vector<llvm::StringRef> body;
+};
+
+struct InclusionOptions {
+	// Hoisted angled inclusions not listed here are dropped; all of them are
+	// kept when this is null or incomplete
+	std::shared_ptr<const RequiredHeaders> required;
+	// Standard headers are replaced by <bits/stdc++.h> when more than this
+	// many of them remain (0: never)
+	unsigned int collapse_threshold = 0;
+};
 
+SimplifiedSource simplify(
+	const UnrolledSource &unrolled,
+	const ReachabilityMarkers &markers,
+	const InclusionOptions &inclusion_options = InclusionOptions());
+
+// The unrolled source with every active line kept
+SimplifiedSource unpruned(const UnrolledSource &unrolled);
+
+#endif
@@ -0,0 +1,13 @@
+int foo(int x){
+	return x;
+}
+int bar(int x){
+	return x;
+}
+int main(){
+	auto f = [](int x){
+		auto g = [](int y){ return foo(y); };
+		return g(x);
+	};
+	return f(1);
+}
@@ -0,0 +1,4 @@
+int foo(){ return 1; } int bar(){ return 2; } int baz(){ return 3; }
+int qux(){ return 4; } int quux(){ return 5; }
+namespace n { int a(){ return 6; } int b(){ return 7; } }
+int main(){ return foo() + baz() + quux() + n::a(); }
@@ -0,0 +1,4 @@
+int foo(){ return 1; } int baz(){ return 3; }
+int quux(){ return 5; }
+namespace n { int a(){ return 6; } }
+int main(){ return foo() + baz() + quux() + n::a(); }
@@ -0,0 +1,11 @@
+#include <limits>
+int used(){
+	return 1;
+}
+int unused(){
+	return 2;
+}
+int table[std::numeric_limits<signed char>::max()];
+int main(){
+	return used() + table[0];
+}
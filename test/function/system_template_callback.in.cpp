@@ -0,0 +1,21 @@
+#include <algorithm>
+#include <vector>
+struct A {
+	int x;
+	int y;
+};
+struct Greater {
+	bool operator()(const A &a, const A &b) const {
+		return a.x > b.x;
+	}
+};
+struct Unused {
+	bool operator()(const A &a, const A &b) const {
+		return a.y > b.y;
+	}
+};
+int main(){
+	std::vector<A> v(3);
+	std::sort(v.begin(), v.end(), Greater());
+	return 0;
+}
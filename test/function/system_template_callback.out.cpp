@@ -0,0 +1,15 @@
+#include <algorithm>
+#include <vector>
+struct A {
+	int x;
+};
+struct Greater {
+	bool operator()(const A &a, const A &b) const {
+		return a.x > b.x;
+	}
+};
+int main(){
+	std::vector<A> v(3);
+	std::sort(v.begin(), v.end(), Greater());
+	return 0;
+}
@@ -0,0 +1,19 @@
+int helper(){ return 1; }
+int unused_helper(){ return 2; }
+struct A {
+	int get() const { return 10; }
+	int put() const { return 11; }
+};
+struct B {
+	int get() const { return 20; }
+	int put() const { return 21; }
+};
+template <typename T>
+int apply(const T &t){
+	return helper() + t.get();
+}
+int main(){
+	apply(A());
+	apply(B());
+	return 0;
+}
@@ -0,0 +1,16 @@
+int helper(){ return 1; }
+struct A {
+	int get() const { return 10; }
+};
+struct B {
+	int get() const { return 20; }
+};
+template <typename T>
+int apply(const T &t){
+	return helper() + t.get();
+}
+int main(){
+	apply(A());
+	apply(B());
+	return 0;
+}
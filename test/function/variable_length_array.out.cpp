@@ -0,0 +1,9 @@
+int size(int n){
+	return n + 1;
+}
+int main(){
+	int n = 3;
+	int a[size(n)];
+	a[0] = 0;
+	return a[0];
+}
@@ -0,0 +1,6 @@
+#include <vector>
+#include <used.hpp>
+#include <cstdio>
+int main(){
+	return used_value();
+}
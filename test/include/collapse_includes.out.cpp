@@ -0,0 +1,5 @@
+#include <bits/stdc++.h>
+#include <used.hpp>
+int main(){
+	return used_value();
+}
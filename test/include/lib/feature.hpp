@@ -0,0 +1,2 @@
+#define LIB_FEATURE 1
+inline int feature_value(){ return 0; }
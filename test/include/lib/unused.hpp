@@ -0,0 +1,4 @@
+#ifndef UNUSED_HPP
+#define UNUSED_HPP
+inline int unused_value(){ return 2; }
+#endif
@@ -0,0 +1,4 @@
+#ifndef USED_HPP
+#define USED_HPP
+inline int used_value(){ return 1; }
+#endif
@@ -0,0 +1,2 @@
+#include_next "next.h"
+inline int outer(){ return inner(); }
@@ -0,0 +1 @@
+inline int inner(){ return 1; }
@@ -0,0 +1 @@
+#include <used.hpp>
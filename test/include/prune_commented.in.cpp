@@ -0,0 +1,5 @@
+/* include <unused.hpp> */ #include "prune_commented.h"
+#include "prune_commented.h" // see <unused.hpp>
+int main(){
+	return used_value();
+}
@@ -0,0 +1,4 @@
+#include <used.hpp>
+int main(){
+	return used_value();
+}
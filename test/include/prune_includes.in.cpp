@@ -0,0 +1,5 @@
+#include <unused.hpp>
+#include <used.hpp>
+int main(){
+	return used_value();
+}
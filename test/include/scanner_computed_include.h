@@ -0,0 +1 @@
+inline int value(){ return 1; }
@@ -0,0 +1,5 @@
+#define HEADER "scanner_computed_include.h"
+#include HEADER
+int main(){
+	return value();
+}
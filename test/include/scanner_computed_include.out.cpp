@@ -0,0 +1,4 @@
+inline int value(){ return 1; }
+int main(){
+	return value();
+}
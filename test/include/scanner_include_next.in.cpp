@@ -0,0 +1,4 @@
+#include "next.h"
+int main(){
+	return outer();
+}
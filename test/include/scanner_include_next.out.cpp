@@ -0,0 +1,5 @@
+inline int inner(){ return 1; }
+inline int outer(){ return inner(); }
+int main(){
+	return outer();
+}
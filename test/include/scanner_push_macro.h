@@ -0,0 +1,4 @@
+#pragma push_macro("value")
+#undef value
+inline int value(){ return 1; }
+#pragma pop_macro("value")
@@ -0,0 +1,4 @@
+#include "scanner_push_macro.h"
+int main(){
+	return value();
+}
@@ -0,0 +1,5 @@
+#if defined(__GNUC__)
+inline int value(){ return 1; }
+#else
+inline int value(){ return 2; }
+#endif
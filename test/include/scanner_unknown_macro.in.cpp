@@ -0,0 +1,4 @@
+#include "scanner_unknown_macro.h"
+int main(){
+	return value();
+}
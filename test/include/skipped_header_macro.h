@@ -0,0 +1,5 @@
+#ifdef LIB_FEATURE
+inline int value(){ return 1; }
+#else
+inline int value(){ return 2; }
+#endif
@@ -0,0 +1,5 @@
+#include <feature.hpp>
+#include "skipped_header_macro.h"
+int main(){
+	return value();
+}
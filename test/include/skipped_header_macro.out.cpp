@@ -0,0 +1,5 @@
+#include <feature.hpp>
+inline int value(){ return 1; }
+int main(){
+	return value();
+}
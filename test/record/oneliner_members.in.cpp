@@ -0,0 +1,2 @@
+struct A { int foo() const { return 10; } int bar() const { return 20; } };
+int main(){ A a; return a.foo(); }
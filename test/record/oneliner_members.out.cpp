@@ -0,0 +1,2 @@
+struct A { int foo() const { return 10; } };
+int main(){ A a; return a.foo(); }
@@ -1,4 +1,4 @@
-import os, sys, re, subprocess;
+import os, sys, re, shutil, tempfile, subprocess;
 import clang.cindex
 
 def print_success(name):
@@ -11,18 +11,142 @@ def tokenize(input_path):
     index = clang.cindex.Index.create()
     tu = index.parse(input_path, args=['-std=c++11'])
     tokens = tu.get_tokens(extent=tu.cursor.extent)
-    return '\n'.join([t.spelling for t in tokens]) + '\n'
+    source_lines = open(input_path).read().split('\n')
+    # Preprocessing directives are kept on their own line as written
+    lines = []
+    directive_end = None
+    previous_line = None
+    for t in tokens:
+        line = t.location.line
+        if directive_end is not None and line <= directive_end:
+            continue
+        directive_end = None
+        if t.spelling == '#' and line != previous_line:
+            # including the lines it is continued on
+            directive_end = line
+            directive = [source_lines[line - 1].strip()]
+            while source_lines[directive_end - 1].rstrip().endswith('\\'):
+                directive_end += 1
+                directive.append(source_lines[directive_end - 1].strip())
+            lines.append('\n'.join(directive))
+        else:
+            lines.append(t.spelling)
+        previous_line = line
+    return '\n'.join(lines) + '\n'
 
-def run_simplify(minifier_path, input_path):
-    proc = subprocess.Popen([minifier_path, input_path], stdout=subprocess.PIPE)
+# Tests run next to their input so that quoted headers are found from stdin
+def run_simplify(minifier_path, input_path, options=[]):
+    proc = subprocess.Popen(
+        [minifier_path] + options + [input_path], stdout=subprocess.PIPE,
+        cwd=os.path.dirname(input_path))
     return proc.communicate()[0].decode('utf-8')
 
-def run_tokenized_simplify(minifier_path, input_path):
+# Same as run_simplify() but also returns the exit status
+def run_simplify_status(minifier_path, input_path, options=[]):
+    proc = subprocess.Popen(
+        [minifier_path] + options + [input_path], stdout=subprocess.PIPE,
+        cwd=os.path.dirname(input_path))
+    output = proc.communicate()[0].decode('utf-8')
+    return proc.returncode, output
+
+def run_tokenized_simplify(minifier_path, input_path, options=[]):
     source = tokenize(input_path)
     proc = subprocess.Popen(
-        [minifier_path, '-'], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        [minifier_path] + options + ['-'],
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+        cwd=os.path.dirname(input_path))
     return proc.communicate(source.encode('utf-8'))[0].decode('utf-8')
 
+# Indexes the library directory given by -I with the index subcommand and
+# runs the test with that index. Returns None when the index is not built.
+def run_indexed_simplify(minifier_path, input_path, options):
+    library = options[options.index('-I') + 1]
+    directory = tempfile.mkdtemp()
+    try:
+        index_path = os.path.join(directory, 'library.index')
+        status = subprocess.call(
+            [minifier_path, 'index', library, '-o', index_path, '-I', library],
+            cwd=os.path.dirname(input_path))
+        if status != 0 or not os.path.exists(index_path):
+            return None
+        return run_simplify(
+            minifier_path, input_path, options + ['--index', index_path])
+    finally:
+        shutil.rmtree(directory)
+
+# Identity of each file in an invocation cache directory; a hit must leave
+# it as it is, since entries are replaced by renaming a new file over them
+def cache_entries(directory):
+    entries = {}
+    for filename in os.listdir(directory):
+        if filename.endswith('.args'):
+            stat = os.stat(os.path.join(directory, filename))
+            entries[filename] = (stat.st_ino, stat.st_mtime)
+    return entries
+
+# Runs the test with an empty invocation cache and then with the one that
+# run filled. Returns the two outputs and whether the cache was written by
+# the first run, hit by the second and missed by a run with another -D.
+def run_cached_simplify(minifier_path, input_path, options):
+    directory = tempfile.mkdtemp()
+    try:
+        cache_options = options + ['--invocation-cache', directory]
+        cold = run_simplify(minifier_path, input_path, cache_options)
+        cold_entries = cache_entries(directory)
+        warm = run_simplify(minifier_path, input_path, cache_options)
+        hit = len(cold_entries) > 0 and cache_entries(directory) == cold_entries
+        run_simplify(
+            minifier_path, input_path,
+            cache_options + ['-D', 'RUN_TEST_INVOCATION_CACHE_MISS'])
+        missed = set(cache_entries(directory)) - set(cold_entries)
+        return cold, warm, hit, len(missed) > 0
+    finally:
+        shutil.rmtree(directory)
+
+# Inputs too large to keep in the tree or whose exit status matters, as
+# (name, input, options, {accepted exit status: expected output}).
+# They are only run as they are, since tokenizing them takes too long.
+def generated_tests():
+    tests = []
+    # A call at the bottom of a 1M-deep left-associative expression
+    depth = 1000000
+    head = 'int used(int a){ return a; }\n'
+    body = 'int main(){\n\tint a = 1;\n\treturn used(a)' + ' + a' * depth + ';\n}\n'
+    tests.append((
+        'generated/deep_expression',
+        head + 'int unused(int a){ return a; }\n' + body, [],
+        { 0: head + body }))
+    # An embedded table of 200k literals next to a function left unused
+    table = 'const int table[] = {' + ','.join(
+        str(i % 1000 - 500) for i in range(200000)) + '};\n'
+    head = 'int used(){ return table[0]; }\n'
+    body = 'int main(){\n\treturn used();\n}\n'
+    tests.append((
+        'generated/literal_table',
+        table + head + 'int unused(){ return table[1]; }\n' + body, [],
+        { 0: table + head + body }))
+    # Budgets: a generous one must not change the output, and an exhausted
+    # one must give the unpruned source with status 2 or nothing with
+    # status 3. Whether a tight budget runs out depends on the machine, so
+    # the pruned output is accepted too.
+    head = '#include <map>\n#include <vector>\nint used(){ return 1; }\n'
+    unused = 'int unused(){ return 2; }\n'
+    body = (
+        'int main(){\n'
+        '\tstd::map<int, std::vector<int>> m;\n'
+        '\treturn used() + static_cast<int>(m.size());\n'
+        '}\n')
+    tests.append((
+        'generated/generous_budget', head + unused + body,
+        ['--deadline', '600000', '--memory-limit', '65536'],
+        { 0: head + body }))
+    for name, options in [
+            ('generated/exhausted_deadline', ['--deadline', '1']),
+            ('generated/exhausted_memory_limit', ['--memory-limit', '1'])]:
+        tests.append((
+            name, head + unused + body, options,
+            { 0: head + body, 2: head + unused + body, 3: '' }))
+    return tests
 
 if __name__ == '__main__':
     if len(sys.argv) < 2:
@@ -50,19 +174,65 @@ if __name__ == '__main__':
         test_name = filepath[len(test_directory):]
         input_path = filepath + '.in.cpp'
         expect_path = filepath + '.out.cpp'
+        # Options for the simplifier, such as -I, in <name>.options
+        options = []
+        if os.path.exists(filepath + '.options'):
+            options = open(filepath + '.options').read().split()
         # normal
         expect = ''.join([s.decode('utf-8') for s in open(expect_path, 'rb').readlines()])
-        actual = run_simplify(minifier_path, input_path)
+        actual = run_simplify(minifier_path, input_path, options)
         if expect == actual:
             print_success(test_name)
             passed_tests.append(test_name)
         else:
             print_failed(test_name)
             failed_tests.append(test_name)
+        # parallel analysis must give the same output as the serial one
+        parallel_name = test_name + ' (jobs 4)'
+        parallel = run_simplify(
+            minifier_path, input_path, options + ['--jobs', '4'])
+        if expect == parallel and actual == parallel:
+            print_success(parallel_name)
+            passed_tests.append(parallel_name)
+        else:
+            print_failed(parallel_name)
+            failed_tests.append(parallel_name)
+        # skipped bodies of system functions cannot be reached from user code
+        skipping_name = test_name + ' (skip system bodies)'
+        skipping = run_simplify(
+            minifier_path, input_path, options + ['--skip-system-bodies'])
+        if expect == skipping:
+            print_success(skipping_name)
+            passed_tests.append(skipping_name)
+        else:
+            print_failed(skipping_name)
+            failed_tests.append(skipping_name)
+        # cached invocations must not change the output, and a second run
+        # must reuse what the first one stored
+        cached_name = test_name + ' (invocation cache)'
+        cold, warm, hit, missed = run_cached_simplify(
+            minifier_path, input_path, options)
+        if expect == cold and expect == warm and hit and missed:
+            print_success(cached_name)
+            passed_tests.append(cached_name)
+        else:
+            print_failed(cached_name)
+            failed_tests.append(cached_name)
+        # an index of the library must not change the output; pruning is
+        # disabled by an index, so those tests are left out
+        if options.count('-I') == 1 and '--prune-includes' not in options:
+            indexed_name = test_name + ' (index)'
+            indexed = run_indexed_simplify(minifier_path, input_path, options)
+            if expect == indexed:
+                print_success(indexed_name)
+                passed_tests.append(indexed_name)
+            else:
+                print_failed(indexed_name)
+                failed_tests.append(indexed_name)
         # tokenized
         test_name += ' (tokenized)'
         expect = tokenize(expect_path)
-        actual = run_tokenized_simplify(minifier_path, input_path)
+        actual = run_tokenized_simplify(minifier_path, input_path, options)
         if expect == actual:
             print_success(test_name)
             passed_tests.append(test_name)
@@ -73,6 +243,22 @@ if __name__ == '__main__':
             print(expect)
             print('---- actual ----')
             print(actual)
+    temp_directory = tempfile.mkdtemp()
+    try:
+        for test_name, source, options, expects in generated_tests():
+            input_path = os.path.join(temp_directory, 'input.cpp')
+            with open(input_path, 'w') as f:
+                f.write(source)
+            status, actual = run_simplify_status(
+                minifier_path, input_path, options)
+            if status in expects and expects[status] == actual:
+                print_success(test_name)
+                passed_tests.append(test_name)
+            else:
+                print_failed(test_name)
+                failed_tests.append(test_name)
+    finally:
+        shutil.rmtree(temp_directory)
     if len(failed_tests) == 0:
         print_success('%d tests.' % len(passed_tests))
     else:
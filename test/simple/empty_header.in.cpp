@@ -0,0 +1,4 @@
+#include "empty_header.h"
+int main(){
+	return 0;
+}
@@ -0,0 +1,15 @@
+typedef short element;
+struct Cell { int value; };
+int unused(){
+	return 0;
+}
+int twice(int x){
+	return x * 2;
+}
+const double ratios[] = { 1, -2, (3), 0x10, 'a', 1.5f, true };
+const int grid[2][3] = { { 1, 2, 3 }, { -4, -5 } };
+const char *names[] = { "a", "b" };
+const int mixed[] = { 1, -2, twice(4), (element)5, sizeof(Cell) };
+int main(){
+	return grid[0][0] + mixed[0];
+}